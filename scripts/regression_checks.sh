@@ -0,0 +1,81 @@
+#!/bin/bash
+# Regression checks for the batch pipeline, run against a built MyJPEGApp:
+#
+#   scripts/regression_checks.sh build/MyJPEGApp master_key.txt image.jpg
+#
+# The image should be large (a few megapixels) so that restart-interval
+# encoding splits it into bands that run on the pool, and its coefficients
+# well over 16 MB for the memory limit check.
+set -u
+app="$1"
+key="$2"
+image="$3"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# Queue depth 1 with a parallel band encode in the writer: transform tasks
+# must never block a worker the writer's encode is waiting for
+mkdir -p "$work/in"
+for i in $(seq 1 24); do
+  cp "$image" "$work/in/copy$i.jpg"
+done
+for threads in 2 3 4 8; do
+  for depth in 1 4; do
+    rm -rf "$work/out"
+    if ! timeout 120 "$app" encrypt -j "$threads" --queue-depth "$depth" \
+        --restart-interval 4 -k "$key" -o "$work/out" "$work/in" \
+        > "$work/log" 2>&1; then
+      echo "FAIL pipeline -j $threads --queue-depth $depth (hung or failed)"
+      failed=1
+    elif [ "$(ls "$work/out" | wc -l)" -ne 24 ]; then
+      echo "FAIL pipeline -j $threads --queue-depth $depth (missing outputs)"
+      failed=1
+    fi
+  done
+done
+[ $failed -eq 0 ] && echo "OK pipeline"
+
+# Peak resident memory (VmHWM) of a command in MB, polled until it exits;
+# sets peak_mb and returns the command's status
+peak_rss() {
+  "$@" > "$work/log" 2>&1 &
+  local pid=$! hwm=0 kb
+  while kill -0 $pid 2>/dev/null; do
+    kb=$(awk '/^VmHWM/ {print $2}' /proc/$pid/status 2>/dev/null)
+    [ -n "$kb" ] && hwm=$kb
+    sleep 0.05
+  done
+  peak_mb=$((hwm / 1024))
+  wait $pid
+}
+
+# --memory-limit: the resident coefficients stay within the limit, so the
+# peak is the limit plus the keystreams (a quarter of the coefficient
+# bytes) plus the program itself
+rm -rf "$work/out"
+"$app" dump -o "$work/out" "$image" > "$work/log" 2>&1
+coefficient_mb=$(( $(cat "$work/out"/*.jcd | wc -c) / 1048576 ))
+limit=16
+if [ "$coefficient_mb" -le $((limit * 2)) ]; then
+  echo "SKIP memory limit (image has only $coefficient_mb MB of coefficients)"
+else
+  rm -rf "$work/out"
+  peak_rss "$app" encrypt -j 2 --memory-limit $limit -k "$key" \
+      -o "$work/out" "$image"
+  status=$?
+  allowed=$((limit + coefficient_mb / 4 + 16))
+  if [ $status -ne 0 ]; then
+    echo "FAIL memory limit (encrypt failed)"
+    failed=1
+  elif [ $peak_mb -gt $allowed ]; then
+    echo "FAIL memory limit: peak RSS $peak_mb MB with --memory-limit" \
+         "$limit, allowed $allowed MB ($coefficient_mb MB of coefficients)"
+    failed=1
+  else
+    echo "OK memory limit: peak RSS $peak_mb MB with --memory-limit" \
+         "$limit ($coefficient_mb MB of coefficients)"
+  fi
+fi
+
+exit $failed
@@ -0,0 +1,65 @@
+#include "arena.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+std::atomic<size_t> Arena::globalPeak{0};
+
+Arena::Arena(size_t chunkSize) : chunkSize(chunkSize) {}
+
+Arena::~Arena() {
+  for (auto &chunk : chunks)
+    std::free(chunk.data);
+}
+
+void *Arena::allocate(size_t size, size_t alignment) {
+  if (chunks.empty())
+    addChunk(size + alignment);
+
+  for (;;) {
+    Chunk &chunk = chunks.back();
+    uintptr_t base = reinterpret_cast<uintptr_t>(chunk.data);
+    uintptr_t aligned = (base + chunk.offset + alignment - 1) &
+                        ~static_cast<uintptr_t>(alignment - 1);
+    size_t end = static_cast<size_t>(aligned - base) + size;
+    if (end <= chunk.size) {
+      usedBytes += end - chunk.offset;
+      chunk.offset = end;
+      peakBytes = std::max(peakBytes, usedBytes);
+
+      size_t seen = globalPeak.load();
+      while (seen < peakBytes &&
+             !globalPeak.compare_exchange_weak(seen, peakBytes)) {
+      }
+      return reinterpret_cast<void *>(aligned);
+    }
+    addChunk(size + alignment);
+  }
+}
+
+void Arena::reset() {
+  if (chunks.size() > 1) {
+    // Replace the spilled chunks with one big enough for all of them
+    size_t total = 0;
+    for (auto &chunk : chunks) {
+      total += chunk.size;
+      std::free(chunk.data);
+    }
+    chunks.clear();
+    addChunk(total);
+  } else if (!chunks.empty()) {
+    chunks.back().offset = 0;
+  }
+  usedBytes = 0;
+}
+
+void Arena::addChunk(size_t minSize) {
+  size_t size = std::max(chunkSize, minSize);
+  char *data = static_cast<char *>(std::malloc(size));
+  if (!data)
+    throw std::bad_alloc();
+  chunks.push_back({data, size, 0});
+}
+
+size_t Arena::globalHighWater() { return globalPeak.load(); }
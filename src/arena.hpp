@@ -0,0 +1,49 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bump allocator: allocations are never freed individually, the whole
+// arena is reset in one operation once the owner is done with them.
+// Not thread-safe; each arena belongs to one JpegContext at a time.
+class Arena {
+public:
+  explicit Arena(size_t chunkSize = 1 << 20);
+  ~Arena();
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Allocate `size` bytes aligned to `alignment` (a power of two)
+  void *allocate(size_t size, size_t alignment = 32);
+
+  // Release every allocation. If the last cycle spilled into several
+  // chunks they are merged into one, so a repeat of the same workload is
+  // served from a single chunk without calling malloc.
+  void reset();
+
+  // Bytes handed out since the last reset
+  size_t used() const { return usedBytes; }
+
+  // Largest used() seen by this arena
+  size_t highWater() const { return peakBytes; }
+
+  // Largest used() seen by any arena in the process
+  static size_t globalHighWater();
+
+private:
+  struct Chunk {
+    char *data;
+    size_t size;
+    size_t offset;
+  };
+
+  void addChunk(size_t minSize);
+
+  std::vector<Chunk> chunks;
+  size_t chunkSize;
+  size_t usedBytes = 0;
+  size_t peakBytes = 0;
+
+  static std::atomic<size_t> globalPeak;
+};
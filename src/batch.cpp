@@ -0,0 +1,205 @@
+#include "batch.hpp"
+#include "bounded_queue.hpp"
+#include "jpeg.hpp"
+#include "memory_budget.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+uint64_t BatchProcessor::estimateCost(const std::filesystem::path &path) {
+  Jpeg::ImageInfo info;
+  return Jpeg::probe(path.wstring(), info) ? info.estimatedCost : 0;
+}
+
+BatchProcessor::BatchProcessor(ThreadPool &pool, size_t maxInFlight)
+    : pool(pool), maxInFlight(maxInFlight) {
+  if (this->maxInFlight == 0)
+    this->maxInFlight = std::max(1u, pool.size());
+}
+
+void BatchProcessor::setMemoryBudget(uint64_t bytes, std::ostream *log) {
+  memoryBudget = bytes;
+  budgetLog = log;
+}
+
+const BatchProcessor::AdmissionStats &BatchProcessor::admissionStats() const {
+  return stats;
+}
+
+std::vector<BatchProcessor::Job>
+BatchProcessor::orderByCost(const std::vector<std::filesystem::path> &inputs) {
+  std::vector<Job> jobs;
+  for (const auto &path : inputs) {
+    Job job;
+    job.path = path;
+    Jpeg::ImageInfo info;
+    if (Jpeg::probe(path.wstring(), info)) {
+      job.cost = info.estimatedCost;
+      job.peakBytes = info.peakBytes;
+    }
+    jobs.push_back(std::move(job));
+  }
+
+  // Largest first: long images start early, small ones fill the gaps
+  std::stable_sort(jobs.begin(), jobs.end(), [](const Job &a, const Job &b) {
+    return a.cost > b.cost;
+  });
+  return jobs;
+}
+
+void BatchProcessor::recordAdmission(const Job &job, double waitMs,
+                                     uint64_t inUse) {
+  ++stats.images;
+  stats.peakBytes = std::max(stats.peakBytes, inUse);
+  if (waitMs <= 0)
+    return;
+  ++stats.waited;
+  stats.totalWaitMs += waitMs;
+  stats.maxWaitMs = std::max(stats.maxWaitMs, waitMs);
+  if (budgetLog) {
+    std::ostringstream line;
+    line << "[BUDGET] " << job.path.filename().string() << " waited "
+         << std::fixed << std::setprecision(1) << waitMs
+         << " ms for its estimated " << (job.peakBytes >> 20)
+         << " MB (budget " << (memoryBudget >> 20) << " MB)\n";
+    *budgetLog << line.str();
+  }
+}
+
+void BatchProcessor::run(const std::vector<std::filesystem::path> &inputs,
+                         const ImageTask &task) {
+  using Clock = std::chrono::steady_clock;
+  const auto jobs = orderByCost(inputs);
+  MemoryBudget budget(memoryBudget);
+  stats = AdmissionStats();
+
+  // Jobs start in order, each once both a slot (at most maxInFlight) and
+  // its memory are free; every finished image starts whatever now fits.
+  // Starting happens under `mutex`, so a job held back for memory is
+  // timed from the first attempt until it gets in.
+  std::mutex mutex;
+  size_t next = 0, inFlight = 0;
+  bool holding = false;
+  Clock::time_point heldSince;
+  std::atomic<size_t> finished{0};
+
+  std::function<void()> startReady = [&]() {
+    while (next < jobs.size() && inFlight < maxInFlight) {
+      const Job &job = jobs[next];
+      if (!budget.tryAcquire(job.peakBytes)) {
+        if (!holding) {
+          holding = true;
+          heldSince = Clock::now();
+        }
+        return;
+      }
+      double waitMs = 0;
+      if (holding) {
+        waitMs = std::chrono::duration<double, std::milli>(Clock::now() -
+                                                           heldSince)
+                     .count();
+        holding = false;
+      }
+      recordAdmission(job, waitMs, budget.inUse());
+
+      size_t index = next++;
+      ++inFlight;
+      pool.submit([&, index]() {
+        task(jobs[index].path);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          budget.release(jobs[index].peakBytes);
+          --inFlight;
+          startReady();
+        }
+        // Bumped last: once it reaches the total, no task touches the
+        // local state of this call any more
+        ++finished;
+      });
+    }
+  };
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    startReady();
+  }
+  pool.helpUntil([&]() { return finished == jobs.size(); });
+}
+
+void BatchProcessor::runPipelined(
+    const std::vector<std::filesystem::path> &inputs,
+    const PipelineStages &stages, size_t queueDepth) {
+  struct Item {
+    std::filesystem::path path;
+    std::unique_ptr<Jpeg> image;
+    uint64_t peakBytes = 0; // admitted against the budget
+  };
+
+  const auto jobs = orderByCost(inputs);
+  BoundedQueue<Item> decoded(queueDepth);
+  BoundedQueue<Item> encrypted(queueDepth);
+  MemoryBudget budget(memoryBudget);
+  stats = AdmissionStats();
+
+  // Stage 1: read + entropy decode, running ahead of the cipher stages.
+  // An image is admitted before it is decoded, since decoding allocates
+  // its coefficients, and released once written or dropped.
+  std::thread reader([&]() {
+    for (const auto &job : jobs) {
+      double waitMs = budget.acquire(job.peakBytes);
+      recordAdmission(job, waitMs, budget.inUse());
+      auto image = stages.read(job.path);
+      if (image)
+        decoded.push({job.path, std::move(image), job.peakBytes});
+      else
+        budget.release(job.peakBytes);
+    }
+    decoded.close();
+  });
+
+  // Stage 3: entropy encode + write, draining behind the cipher stages
+  std::thread writer([&]() {
+    Item item;
+    while (encrypted.pop(item)) {
+      stages.write(*item.image, item.path);
+      item.image.reset();
+      budget.release(item.peakBytes);
+    }
+  });
+
+  // Stage 2: cipher stages on the pool, at most maxInFlight at a time.
+  // Each image holds its slot in `encrypted` before its task is submitted:
+  // a task blocked on a full queue would hold a worker that the writer's
+  // own parallel encode may be waiting for.
+  TaskGroup group(pool);
+  std::atomic<size_t> inFlight{0};
+  Item item;
+  while (decoded.pop(item)) {
+    pool.helpUntil([&]() { return inFlight < maxInFlight; });
+    encrypted.reserve();
+
+    ++inFlight;
+    auto shared = std::make_shared<Item>(std::move(item));
+    group.run([&, shared]() {
+      if (stages.transform(*shared->image, shared->path)) {
+        encrypted.pushReserved(std::move(*shared));
+      } else {
+        shared->image.reset();
+        budget.release(shared->peakBytes);
+        encrypted.cancelReserved();
+      }
+      --inFlight;
+    });
+  }
+
+  group.wait();
+  encrypted.close();
+  reader.join();
+  writer.join();
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+class Jpeg;
+class ThreadPool;
+
+// Callbacks for the three stages of a pipelined batch
+struct PipelineStages {
+  // Read the file and entropy-decode it; nullptr on failure
+  std::function<std::unique_ptr<Jpeg>(const std::filesystem::path &)> read;
+
+  // Run the cipher stages in memory; false drops the image
+  std::function<bool(Jpeg &, const std::filesystem::path &)> transform;
+
+  // Entropy-encode and write the result
+  std::function<void(Jpeg &, const std::filesystem::path &)> write;
+};
+
+// Schedules a batch of images on the shared worker pool.
+//
+// Images are ordered by estimated cost (largest first, so the long ones do
+// not end up as the tail of the batch) and at most `maxInFlight` of them
+// are processed at once, which keeps memory bounded while the per-image
+// stage graphs fill the remaining workers. With a memory budget, images
+// are also admitted only while their estimated peak memory, summed over
+// the images in flight, stays within it.
+class BatchProcessor {
+public:
+  using ImageTask = std::function<void(const std::filesystem::path &)>;
+
+  // maxInFlight = 0 uses one image per worker
+  explicit BatchProcessor(ThreadPool &pool, size_t maxInFlight = 0);
+
+  // Process every input with `task` and return once all are done
+  void run(const std::vector<std::filesystem::path> &inputs,
+           const ImageTask &task);
+
+  // Process every input as a read -> transform -> write pipeline. A reader
+  // and a writer thread overlap file I/O and entropy coding with the cipher
+  // stages on the pool; at most `queueDepth` decoded images wait for the
+  // cipher, and at most `queueDepth` are encrypted or wait for the writer.
+  void runPipelined(const std::vector<std::filesystem::path> &inputs,
+                    const PipelineStages &stages, size_t queueDepth = 4);
+
+  // Admit images in order only while the sum of their estimated peak
+  // memory (Jpeg::ImageInfo::peakBytes) stays within `bytes`; 0, the
+  // default, turns the budget off. Every image that had to wait is logged
+  // to `log`, if given.
+  void setMemoryBudget(uint64_t bytes, std::ostream *log = nullptr);
+
+  // Admission figures of the last run
+  struct AdmissionStats {
+    size_t images = 0; // admitted
+    size_t waited = 0; // of those, held back for memory
+    double totalWaitMs = 0;
+    double maxWaitMs = 0;
+    uint64_t peakBytes = 0; // largest estimated total in flight
+  };
+  const AdmissionStats &admissionStats() const;
+
+  // Estimated work for one image from its header (see Jpeg::probe); 0 if
+  // the header cannot be read
+  static uint64_t estimateCost(const std::filesystem::path &path);
+
+private:
+  struct Job {
+    std::filesystem::path path;
+    uint64_t cost = 0;
+    uint64_t peakBytes = 0;
+  };
+
+  // Inputs ordered by decreasing estimated cost
+  static std::vector<Job>
+  orderByCost(const std::vector<std::filesystem::path> &inputs);
+
+  void recordAdmission(const Job &job, double waitMs, uint64_t inUse);
+
+  ThreadPool &pool;
+  size_t maxInFlight;
+  uint64_t memoryBudget = 0;
+  std::ostream *budgetLog = nullptr;
+  AdmissionStats stats;
+};
@@ -0,0 +1,82 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// Blocking FIFO with a fixed capacity, used between pipeline stages.
+// Producers block while the queue is full, consumers while it is empty.
+// A producer that must not block (a pool task) has its slot reserved up
+// front and fills it with pushReserved.
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+  // Append an item; returns false if the queue was closed
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this]() { return closed || hasRoom(); });
+    if (closed)
+      return false;
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Block until a slot is free and hold it for pushReserved or
+  // cancelReserved; returns false if the queue was closed
+  bool reserve() {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this]() { return closed || hasRoom(); });
+    if (closed)
+      return false;
+    ++reserved;
+    return true;
+  }
+
+  // Append an item into a slot held by reserve(); never blocks
+  void pushReserved(T item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    --reserved;
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+  }
+
+  // Give back a slot held by reserve() without pushing
+  void cancelReserved() {
+    std::lock_guard<std::mutex> lock(mutex);
+    --reserved;
+    notFull.notify_one();
+  }
+
+  // Take the oldest item; returns false once closed and drained
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+    if (items.empty())
+      return false;
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed; wakes every waiting thread
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+private:
+  bool hasRoom() const { return items.size() + reserved < capacity; }
+
+  const size_t capacity;
+  std::deque<T> items;
+  size_t reserved = 0; // slots held by reserve()
+  std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  bool closed = false;
+};
@@ -1,4 +1,5 @@
 #include "chaotic_keystream_generator.hpp"
+#include <algorithm>
 #include <cmath>
 #include <random>
 #include <vector>
@@ -11,6 +12,7 @@ std::vector<double> Arnold3DKeystreamGenerator::generateKeystream(
     int modN, int x0, int y0, int z0) {
 
   std::vector<double> keystream;
+  keystream.reserve(size_t(std::max(steps, 0)) * 3);
   int x = x0, y = y0, z = z0;
 
   // Burn-in phase
@@ -113,6 +115,7 @@ std::vector<double>
 LogisticKeystreamGenerator::generateKeystream(int length, double x0, double r,
                                               int burn_in, double epsilon) {
   std::vector<double> keystream;
+  keystream.reserve(std::max(length, 0));
   double x = x0;
 
   // Burn-in phase
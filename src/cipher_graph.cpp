@@ -0,0 +1,225 @@
+#include "cipher_graph.hpp"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Kind = KeystreamCache::Kind;
+using KeyPtr = std::shared_ptr<const ChaoticSystems::MasterKey>;
+
+// Keystreams produced by the keystream nodes and consumed by the stages.
+// The key-only ones are shared, possibly with the cache and other images.
+struct LaneKeys {
+  KeystreamCache::Stream<int> dcPermutation;
+  KeystreamCache::Stream<double> dcSubstitution;
+  KeystreamCache::Stream<int> acInterBlock;
+  std::vector<std::vector<int>> acIntraBlock; // by non-zero group count
+  KeystreamCache::Stream<double> acSubstitution;
+};
+
+// One cipher round: its key (owned by the graph's nodes), its number and
+// the prefix of its node names
+struct Round {
+  KeyPtr key;
+  int index = 0;
+  std::string prefix;
+};
+
+// Keystream from the cache when there is one, else freshly generated
+KeystreamCache::Stream<int>
+intStream(KeystreamCache *cache, Kind kind, int round, int length,
+          const std::function<std::vector<int>()> &make) {
+  if (cache)
+    return cache->ints(kind, round, length, make);
+  return std::make_shared<const std::vector<int>>(make());
+}
+
+KeystreamCache::Stream<double>
+doubleStream(KeystreamCache *cache, Kind kind, int round, int length,
+             const std::function<std::vector<double>()> &make) {
+  if (cache)
+    return cache->doubles(kind, round, length, make);
+  return std::make_shared<const std::vector<double>>(make());
+}
+
+void addDCStages(StageGraph &graph, Jpeg &img, const Round &round,
+                 KeystreamCache *cache, bool isLuminance) {
+  auto keys = std::make_shared<LaneKeys>();
+  const KeyPtr key = round.key;
+  const int index = round.index;
+  const int lane = isLuminance ? LumaDC : ChromaDC;
+  const std::string name = round.prefix + "DC " +
+                           (isLuminance ? "Luminance" : "Chrominance");
+  const int lenDC = img.blockCount(isLuminance);
+
+  int permKS = graph.addKeystream(
+      name + " Permutation Keystream", lane,
+      [&img, key, index, cache, keys, lenDC]() {
+        keys->dcPermutation =
+            intStream(cache, Kind::DCPermutation, index, lenDC, [&]() {
+              return img.generateDCPermutationKeystream(lenDC, *key);
+            });
+      });
+  graph.addStage(
+      name + " Permutation", lane,
+      [&img, keys, isLuminance]() {
+        img.processDCWithKey(isLuminance, *keys->dcPermutation);
+      },
+      [&img, keys, isLuminance]() {
+        img.processDCReverse(isLuminance, *keys->dcPermutation);
+      },
+      {permKS});
+
+  int subKS = graph.addKeystream(
+      name + " Substitution Keystream", lane,
+      [key, index, cache, keys, lenDC]() {
+        keys->dcSubstitution =
+            doubleStream(cache, Kind::Logistic, index, lenDC, [&]() {
+              return key->generateLogisticKeystream(lenDC);
+            });
+      });
+  graph.addStage(
+      name + " Substitution", lane,
+      [&img, key, keys, isLuminance]() {
+        img.applyDC(img.substituteDC(img.extractDC(isLuminance),
+                                     *keys->dcSubstitution, key->alpha),
+                    isLuminance);
+      },
+      [&img, key, keys, isLuminance]() {
+        img.applyDC(img.decryptDC(img.extractDC(isLuminance),
+                                  *keys->dcSubstitution, key->alpha),
+                    isLuminance);
+      },
+      {subKS});
+}
+
+void addACStages(StageGraph &graph, Jpeg &img, const Round &round,
+                 KeystreamCache *cache, bool isLuminance) {
+  auto keys = std::make_shared<LaneKeys>();
+  const KeyPtr key = round.key;
+  const int index = round.index;
+  const int lane = isLuminance ? LumaAC : ChromaAC;
+  const std::string name = round.prefix + "AC " +
+                           (isLuminance ? "Luminance" : "Chrominance");
+  const int numBlocks = img.blockCount(isLuminance);
+
+  int interKS = graph.addKeystream(
+      name + " Inter-block Permutation Keystream", lane,
+      [&img, key, index, cache, keys, numBlocks]() {
+        keys->acInterBlock =
+            intStream(cache, Kind::ACInterBlock, index, numBlocks, [&]() {
+              return img.generateACInterBlockPermutationKey(
+                  numBlocks, key->alpha,
+                  key->generateLogisticKeystream(numBlocks - 1));
+            });
+      });
+  graph.addStage(
+      name + " Inter-block Permutation", lane,
+      [&img, keys, isLuminance]() {
+        img.permuteACBlocks(isLuminance, *keys->acInterBlock);
+      },
+      [&img, keys, isLuminance]() {
+        img.reversePermuteACBlocks(isLuminance, *keys->acInterBlock);
+      },
+      {interKS});
+
+  // One key per non-zero group count; the stage picks each block's key
+  // from the block as it is right before the shuffle
+  int intraKS = graph.addKeystream(
+      name + " Intra-block Permutation Keystream", lane, [key, keys]() {
+        keys->acIntraBlock = Jpeg::generateACIntraBlockKeys(*key);
+      });
+  graph.addStage(
+      name + " Intra-block Permutation", lane,
+      [&img, keys, isLuminance]() {
+        img.processACIntraBlock(isLuminance, keys->acIntraBlock);
+      },
+      [&img, keys, isLuminance]() {
+        img.processACIntraBlock(isLuminance, keys->acIntraBlock, true);
+      },
+      {intraKS});
+
+  int subKS = graph.addKeystream(
+      name + " Substitution Keystream", lane,
+      [key, index, cache, keys, numBlocks]() {
+        keys->acSubstitution =
+            doubleStream(cache, Kind::Logistic, index, numBlocks, [&]() {
+              return key->generateLogisticKeystream(numBlocks);
+            });
+      });
+  graph.addStage(
+      name + " Substitution", lane,
+      [&img, keys, isLuminance]() {
+        img.substituteACInterBlock(isLuminance, *keys->acSubstitution);
+      },
+      [&img, keys, isLuminance]() {
+        img.reverseSubstituteACInterBlock(isLuminance,
+                                         *keys->acSubstitution);
+      },
+      {subKS});
+}
+
+// dc+acsign: the AC coefficients keep their blocks, positions and
+// magnitudes; only their signs are substituted
+void addACSignStage(StageGraph &graph, Jpeg &img, const Round &round,
+                    KeystreamCache *cache, bool isLuminance) {
+  auto keys = std::make_shared<LaneKeys>();
+  const KeyPtr key = round.key;
+  const int index = round.index;
+  const int lane = isLuminance ? LumaAC : ChromaAC;
+  const std::string name = round.prefix + "AC " +
+                           (isLuminance ? "Luminance" : "Chrominance");
+
+  // One value per non-zero coefficient; sign flips keep that count, so
+  // it is the same in both directions
+  int subKS = graph.addKeystream(
+      name + " Sign Substitution Keystream", lane,
+      [&img, key, index, cache, keys, isLuminance]() {
+        int length = static_cast<int>(img.countNonZeroAC(isLuminance));
+        keys->acSubstitution =
+            doubleStream(cache, Kind::Logistic, index, length, [&]() {
+              return key->generateLogisticKeystream(length);
+            });
+      },
+      true);
+  graph.addStage(
+      name + " Sign Substitution", lane,
+      [&img, key, keys, isLuminance]() {
+        img.substituteACSigns(isLuminance, *keys->acSubstitution, key->alpha);
+      },
+      [&img, key, keys, isLuminance]() {
+        img.reverseSubstituteACSigns(isLuminance, *keys->acSubstitution,
+                                     key->alpha);
+      },
+      {subKS});
+}
+
+} // namespace
+
+void buildCipherGraph(StageGraph &graph, Jpeg &img,
+                      const ChaoticSystems::MasterKey &key,
+                      KeystreamCache *cache, CipherProfile::Level level,
+                      int rounds) {
+  // All rounds go into one graph: each lane chains its stages round after
+  // round, and the Decrypt direction walks them back from the last round
+  for (int index = 0; index < rounds; ++index) {
+    Round round;
+    round.key =
+        std::make_shared<const ChaoticSystems::MasterKey>(key.roundKey(index));
+    round.index = index;
+    if (rounds > 1)
+      round.prefix = "R" + std::to_string(index + 1) + " ";
+
+    addDCStages(graph, img, round, cache, true);
+    addDCStages(graph, img, round, cache, false);
+    if (level == CipherProfile::Level::Full) {
+      addACStages(graph, img, round, cache, true);
+      addACStages(graph, img, round, cache, false);
+    } else if (level == CipherProfile::Level::DCACSign) {
+      addACSignStage(graph, img, round, cache, true);
+      addACSignStage(graph, img, round, cache, false);
+    }
+  }
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "cipher_profile.hpp"
+#include "jpeg.hpp"
+#include "keystream_cache.hpp"
+#include "master_key.hpp"
+#include "stage_graph.hpp"
+
+// Coefficient sets that the cipher stages of one image operate on. Stages
+// of different lanes never touch the same coefficients.
+enum CipherLane { LumaDC = 0, ChromaDC = 1, LumaAC = 2, ChromaAC = 3 };
+
+// Declare the keystream, permutation and substitution stages of the
+// algorithm for one image, as far as `level` asks for them, once per
+// round with that round's sub-key (MasterKey::roundKey). Run the graph in
+// the Encrypt direction to encrypt and in the Decrypt direction to restore
+// the image. With a cache (which must only ever be used with this key),
+// keystreams that depend on the round key and their length alone are
+// taken from it.
+void buildCipherGraph(
+    StageGraph &graph, Jpeg &img, const ChaoticSystems::MasterKey &key,
+    KeystreamCache *cache = nullptr,
+    CipherProfile::Level level = CipherProfile::Level::Full, int rounds = 1);
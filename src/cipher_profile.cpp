@@ -0,0 +1,110 @@
+#include "cipher_profile.hpp"
+#include <cstdint>
+#include <sstream>
+
+namespace {
+
+const int maxRounds = 16;
+
+bool parseNumber(const std::string &text, long &value) {
+  if (text.empty() || text.size() > 10 ||
+      text.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  value = std::stol(text);
+  return true;
+}
+
+} // namespace
+
+std::string CipherProfile::name() const {
+  std::string text = level == Level::DC         ? "dc"
+                     : level == Level::DCACSign ? "dc+acsign"
+                                                : "full";
+  if (rounds != 1)
+    text += "+rounds=" + std::to_string(rounds);
+  return text;
+}
+
+bool parseCipherProfile(const std::string &text, CipherProfile &profile) {
+  CipherProfile parsed;
+  std::string levelName = text;
+  const std::string roundsOption = "+rounds=";
+  size_t suffix = text.find(roundsOption);
+  if (suffix != std::string::npos) {
+    long rounds = 0;
+    if (!parseNumber(text.substr(suffix + roundsOption.size()), rounds) ||
+        rounds < 1 || rounds > maxRounds)
+      return false;
+    parsed.rounds = int(rounds);
+    levelName = text.substr(0, suffix);
+  }
+
+  if (levelName == "dc")
+    parsed.level = CipherProfile::Level::DC;
+  else if (levelName == "dc+acsign")
+    parsed.level = CipherProfile::Level::DCACSign;
+  else if (levelName == "full")
+    parsed.level = CipherProfile::Level::Full;
+  else
+    return false;
+  profile = parsed;
+  return true;
+}
+
+bool parseRegion(const std::string &text, Jpeg::Region &region) {
+  long parts[4];
+  size_t start = 0;
+  for (int i = 0; i < 4; ++i) {
+    size_t end = i < 3 ? text.find(',', start) : text.size();
+    if (end == std::string::npos ||
+        !parseNumber(text.substr(start, end - start), parts[i]) ||
+        parts[i] > INT32_MAX)
+      return false;
+    start = end + 1;
+  }
+  region = {int(parts[0]), int(parts[1]), int(parts[2]), int(parts[3])};
+  return region.width > 0 && region.height > 0;
+}
+
+std::string formatCipherTag(const CipherProfile &profile,
+                            const std::vector<Jpeg::Region> &regions) {
+  std::ostringstream tag;
+  tag << "profile=" << profile.name();
+  for (size_t i = 0; i < regions.size(); ++i) {
+    const Jpeg::Region &region = regions[i];
+    tag << (i == 0 ? " roi=" : ";") << region.x << "," << region.y << ","
+        << region.width << "," << region.height;
+  }
+  return tag.str();
+}
+
+bool parseCipherTag(const std::string &tag, CipherProfile &profile,
+                    std::vector<Jpeg::Region> &regions) {
+  std::istringstream fields(tag);
+  std::string field;
+  bool hasProfile = false;
+  CipherProfile parsedProfile;
+  std::vector<Jpeg::Region> parsedRegions;
+  while (fields >> field) {
+    if (field.compare(0, 8, "profile=") == 0) {
+      if (!parseCipherProfile(field.substr(8), parsedProfile))
+        return false;
+      hasProfile = true;
+    } else if (field.compare(0, 4, "roi=") == 0) {
+      std::istringstream list(field.substr(4));
+      std::string item;
+      while (std::getline(list, item, ';')) {
+        Jpeg::Region region;
+        if (!parseRegion(item, region))
+          return false;
+        parsedRegions.push_back(region);
+      }
+    }
+    // Unknown fields are left to later versions
+  }
+  if (!hasProfile)
+    return false;
+  profile = parsedProfile;
+  regions = parsedRegions;
+  return true;
+}
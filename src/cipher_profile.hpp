@@ -0,0 +1,34 @@
+#pragma once
+#include "jpeg.hpp"
+#include <string>
+#include <vector>
+
+// How much of an image the cipher protects. Lower levels skip stages of
+// the full algorithm for throughput:
+//   dc          DC permutation and substitution only
+//   dc+acsign   DC stages plus a keyed, chained flip of the AC signs
+//   full        every stage (the default)
+// Any level takes a "+rounds=N" suffix, e.g. full+rounds=3.
+struct CipherProfile {
+  enum class Level { DC, DCACSign, Full };
+  Level level = Level::Full;
+  int rounds = 1;
+
+  std::string name() const;
+};
+
+// Parse a profile name as above; false if it is not one
+bool parseCipherProfile(const std::string &text, CipherProfile &profile);
+
+// X,Y,W,H in pixels, W and H non-zero
+bool parseRegion(const std::string &text, Jpeg::Region &region);
+
+// Text recorded in encrypted files (see Jpeg::setTag) so decryption runs
+// the matching graph: "profile=<name>", then " roi=X,Y,W,H;..." when the
+// cipher was limited to regions
+std::string formatCipherTag(const CipherProfile &profile,
+                            const std::vector<Jpeg::Region> &regions);
+
+// Read a tag written by formatCipherTag; false if it is not one
+bool parseCipherTag(const std::string &tag, CipherProfile &profile,
+                    std::vector<Jpeg::Region> &regions);
@@ -0,0 +1,378 @@
+#include "cli.hpp"
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Wildcard match supporting * and ?
+bool matchesPattern(const std::string &name, const std::string &pattern) {
+  size_t n = 0, p = 0, starP = std::string::npos, starN = 0;
+  while (n < name.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+      ++n;
+      ++p;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      starP = p++;
+      starN = n;
+    } else if (starP != std::string::npos) {
+      p = starP + 1;
+      n = ++starN;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern.size() && pattern[p] == '*')
+    ++p;
+  return p == pattern.size();
+}
+
+// Append the files an input stands for; false if it names nothing
+bool expandInput(const std::string &input, std::vector<fs::path> &files) {
+  fs::path path(input);
+  std::error_code ec;
+
+  if (fs::is_directory(path, ec)) {
+    std::vector<fs::path> entries;
+    for (auto &entry : fs::directory_iterator(path, ec)) {
+      if (entry.is_regular_file())
+        entries.push_back(entry.path());
+    }
+    std::sort(entries.begin(), entries.end());
+    files.insert(files.end(), entries.begin(), entries.end());
+    return true;
+  }
+
+  std::string name = path.filename().string();
+  if (name.find_first_of("*?") == std::string::npos) {
+    if (!fs::is_regular_file(path, ec))
+      return false;
+    files.push_back(path);
+    return true;
+  }
+
+  // Glob in the file name part (shells on Windows do not expand them)
+  fs::path dir = path.has_parent_path() ? path.parent_path() : fs::path(".");
+  std::vector<fs::path> matches;
+  for (auto &entry : fs::directory_iterator(dir, ec)) {
+    if (entry.is_regular_file() &&
+        matchesPattern(entry.path().filename().string(), name))
+      matches.push_back(path.has_parent_path() ? entry.path()
+                                               : entry.path().filename());
+  }
+  std::sort(matches.begin(), matches.end());
+  files.insert(files.end(), matches.begin(), matches.end());
+  return !matches.empty();
+}
+
+bool parseHuffmanMode(const std::string &value, Jpeg::HuffmanMode &mode) {
+  if (value == "standard")
+    mode = Jpeg::HuffmanMode::Standard;
+  else if (value == "original")
+    mode = Jpeg::HuffmanMode::Original;
+  else if (value == "optimized")
+    mode = Jpeg::HuffmanMode::Optimized;
+  else
+    return false;
+  return true;
+}
+
+bool parseScanMode(const std::string &value, Jpeg::ScanMode &mode) {
+  if (value == "source")
+    mode = Jpeg::ScanMode::Source;
+  else if (value == "baseline")
+    mode = Jpeg::ScanMode::Baseline;
+  else if (value == "progressive")
+    mode = Jpeg::ScanMode::Progressive;
+  else
+    return false;
+  return true;
+}
+
+bool parseUnsigned(const std::string &value, unsigned &out) {
+  if (value.empty() ||
+      value.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  try {
+    out = static_cast<unsigned>(std::stoul(value));
+  } catch (const std::exception &) {
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+bool parseCommandLine(int argc, char **argv, CommandLine &cli,
+                      std::string &error) {
+  if (argc < 2) {
+    error = "missing command";
+    return false;
+  }
+  cli.command = argv[1];
+  static const char *commands[] = {"encrypt", "decrypt", "reencrypt",
+                                   "verify",  "bench",   "keygen",
+                                   "serve",   "dump"};
+  if (std::find(std::begin(commands), std::end(commands), cli.command) ==
+      std::end(commands)) {
+    error = "unknown command '" + cli.command + "'";
+    return false;
+  }
+
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    static const char *valueOptions[] = {
+        "-o", "--out", "-k", "--key", "-m", "--manifest", "-j", "--threads",
+        "--restart-interval", "--huffman", "--scan-mode", "--socket",
+        "--memory-limit", "--memory-budget", "--new-key", "--roi",
+        "--profile", "--queue-depth"};
+    bool takesValue = std::find(std::begin(valueOptions),
+                                std::end(valueOptions),
+                                arg) != std::end(valueOptions);
+    if (takesValue && i + 1 >= argc) {
+      error = "missing value for " + arg;
+      return false;
+    }
+
+    if (arg == "-o" || arg == "--out") {
+      cli.outDir = argv[++i];
+    } else if (arg == "-k" || arg == "--key") {
+      cli.keyFile = argv[++i];
+    } else if (arg == "--new-key") {
+      cli.newKeyFile = argv[++i];
+    } else if (arg == "-m" || arg == "--manifest") {
+      cli.manifest = argv[++i];
+    } else if (arg == "-j" || arg == "--threads") {
+      if (!parseUnsigned(argv[++i], cli.threads)) {
+        error = "bad thread count '" + std::string(argv[i]) + "'";
+        return false;
+      }
+    } else if (arg == "--memory-limit") {
+      if (!parseUnsigned(argv[++i], cli.memoryLimit)) {
+        error = "bad memory limit '" + std::string(argv[i]) + "'";
+        return false;
+      }
+    } else if (arg == "--memory-budget") {
+      if (!parseUnsigned(argv[++i], cli.memoryBudget)) {
+        error = "bad memory budget '" + std::string(argv[i]) + "'";
+        return false;
+      }
+    } else if (arg == "--queue-depth") {
+      if (!parseUnsigned(argv[++i], cli.queueDepth) || cli.queueDepth < 1) {
+        error = "bad queue depth '" + std::string(argv[i]) + "'";
+        return false;
+      }
+    } else if (arg == "--restart-interval") {
+      if (!parseUnsigned(argv[++i], cli.output.restartInterval)) {
+        error = "bad restart interval '" + std::string(argv[i]) + "'";
+        return false;
+      }
+    } else if (arg == "--huffman") {
+      if (!parseHuffmanMode(argv[++i], cli.output.huffmanMode)) {
+        error = "bad Huffman mode '" + std::string(argv[i]) + "'";
+        return false;
+      }
+    } else if (arg == "--scan-mode") {
+      if (!parseScanMode(argv[++i], cli.output.scanMode)) {
+        error = "bad scan mode '" + std::string(argv[i]) + "'";
+        return false;
+      }
+    } else if (arg == "--profile") {
+      std::istringstream list(argv[++i]);
+      std::string name;
+      cli.benchProfiles.clear();
+      while (std::getline(list, name, ',')) {
+        std::vector<std::string> names = {name};
+        if (name == "all")
+          names = {"dc", "dc+acsign", "full"};
+        for (const std::string &each : names) {
+          cli.benchProfiles.emplace_back();
+          if (!parseCipherProfile(each, cli.benchProfiles.back())) {
+            error = "bad profile '" + name + "'";
+            return false;
+          }
+        }
+      }
+      if (cli.benchProfiles.empty()) {
+        error = "bad profile ''";
+        return false;
+      }
+      cli.profile = cli.benchProfiles.front();
+    } else if (arg == "--roi") {
+      Jpeg::Region region;
+      if (!parseRegion(argv[++i], region)) {
+        error = "bad region '" + std::string(argv[i]) + "' (want X,Y,W,H)";
+        return false;
+      }
+      cli.regions.push_back(region);
+    } else if (arg == "--socket") {
+      cli.socket = argv[++i];
+    } else if (arg == "--scan-report") {
+      cli.output.scanReport = true;
+    } else if (arg == "--force") {
+      cli.force = true;
+    } else if (arg == "--frames") {
+      cli.frames = true;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      error = "unknown option " + arg;
+      return false;
+    } else {
+      cli.inputs.push_back(arg);
+    }
+  }
+
+  const bool usesInputs = cli.command != "keygen" && cli.command != "serve";
+  if (usesInputs && cli.inputs.empty() && cli.manifest.empty()) {
+    error = "no inputs given";
+    return false;
+  }
+  if (!usesInputs && (!cli.inputs.empty() || !cli.manifest.empty())) {
+    error = cli.command + " takes no inputs";
+    return false;
+  }
+  if (cli.command == "serve" && cli.socket.empty()) {
+    error = "serve needs --socket PATH";
+    return false;
+  }
+  if ((cli.command == "reencrypt") != !cli.newKeyFile.empty()) {
+    error = cli.command == "reencrypt" ? "reencrypt needs --new-key FILE"
+                                       : "--new-key applies to reencrypt";
+    return false;
+  }
+  if (!cli.socket.empty() && cli.command != "serve" &&
+      cli.command != "encrypt" && cli.command != "decrypt") {
+    error = "--socket applies to serve, encrypt and decrypt";
+    return false;
+  }
+  if (cli.frames && ((cli.command != "encrypt" && cli.command != "decrypt") ||
+                     !cli.socket.empty())) {
+    error = "--frames applies to encrypt and decrypt without --socket";
+    return false;
+  }
+  if (cli.benchProfiles.size() > 1 && cli.command != "bench") {
+    error = "several profiles apply to bench";
+    return false;
+  }
+  if (!cli.regions.empty() && !cli.socket.empty()) {
+    error = "--roi cannot be sent to a daemon";
+    return false;
+  }
+  // The daemon encrypts with the profile it was started with
+  if (!cli.benchProfiles.empty() && !cli.socket.empty() &&
+      cli.command != "serve") {
+    error = "--profile cannot be sent to a daemon";
+    return false;
+  }
+  bool piped = std::find(cli.inputs.begin(), cli.inputs.end(), "-") !=
+               cli.inputs.end();
+  if (piped && !cli.socket.empty()) {
+    error = "stdin input cannot be sent to a daemon";
+    return false;
+  }
+  if (piped && (cli.inputs.size() > 1 || !cli.manifest.empty() ||
+                (cli.command != "encrypt" && cli.command != "decrypt"))) {
+    error = "'-' (stdin -> stdout) must be the only input of "
+            "encrypt or decrypt";
+    return false;
+  }
+  return true;
+}
+
+void printUsage(std::ostream &out) {
+  out << "Usage: MyJPEGApp <command> [options] [inputs...]\n"
+         "\n"
+         "Commands:\n"
+         "  encrypt   encrypt inputs into the output directory\n"
+         "  decrypt   decrypt inputs into the output directory\n"
+         "  reencrypt decrypt with the key (-k) and encrypt with --new-key\n"
+         "            in one pass, into the output directory; an\n"
+         "            interrupted run resumes where it stopped\n"
+         "  verify    encrypt and decrypt in memory and compare, no output\n"
+         "  bench     time decode, encryption and encode, no output\n"
+         "  keygen    write a new random master key to the key file\n"
+         "  dump      convert JPEGs to coefficient dumps (<name>.jcd) and\n"
+         "            dumps back to JPEG (<name>.jpg) in the output\n"
+         "            directory; the other commands read dumps without\n"
+         "            entropy decoding and write them back as dumps\n"
+         "  serve     keep the key loaded and encrypt/decrypt for clients\n"
+         "            on a Unix domain socket (--socket) until stopped\n"
+         "\n"
+         "Inputs: files, directories, glob patterns (*.jpg), or - to read\n"
+         "stdin and write stdout (encrypt/decrypt, single input)\n"
+         "With --frames, every input is a stream of JPEG frames (MJPEG or\n"
+         "MJPEG-in-AVI) written under the same name; - streams frames live\n"
+         "\n"
+         "Options:\n"
+         "  -o, --out DIR            output directory (default .)\n"
+         "  -k, --key FILE           master key (default master_key.txt)\n"
+         "  --new-key FILE           reencrypt: master key to rotate to\n"
+         "  -m, --manifest FILE      read inputs from FILE, one per line\n"
+         "  -j, --threads N          worker threads (default: all cores)\n"
+         "  --memory-limit MB        keep at most MB of an image's\n"
+         "                           coefficients in RAM, the rest in a\n"
+         "                           mapped temporary file\n"
+         "  --memory-budget MB       start images only while their estimated\n"
+         "                           memory in total stays within MB\n"
+         "  --queue-depth N          images buffered between pipeline stages\n"
+         "                           (default 4)\n"
+         "  --restart-interval N     RST markers every N MCUs (parallel "
+         "encode)\n"
+         "  --huffman MODE           standard | original | optimized\n"
+         "  --scan-mode MODE         source | baseline | progressive\n"
+         "  --scan-report            log the scans of every input\n"
+         "  --profile NAME           dc | dc+acsign | full (default), each\n"
+         "                           optionally +rounds=N; recorded in the\n"
+         "                           output, so decrypt needs it only for\n"
+         "                           files encrypted before profiles;\n"
+         "                           bench: a comma-separated list (e.g.\n"
+         "                           full,full+rounds=2) or all compares\n"
+         "                           them\n"
+         "  --roi X,Y,W,H            encrypt only the blocks covering this\n"
+         "                           pixel rectangle (repeatable); recorded\n"
+         "                           like the profile\n"
+         "  --force                  keygen: overwrite an existing key\n"
+         "  --frames                 encrypt/decrypt: inputs are MJPEG or\n"
+         "                           AVI frame streams; reports frames/s\n"
+         "  --socket PATH            serve: socket to listen on;\n"
+         "                           encrypt/decrypt: send the work to the\n"
+         "                           daemon there (output options and the\n"
+         "                           profile are the daemon's)\n";
+}
+
+bool collectInputs(const CommandLine &cli, std::vector<fs::path> &files,
+                   std::string &error) {
+  std::vector<std::string> inputs = cli.inputs;
+  if (!cli.manifest.empty()) {
+    std::ifstream manifest(cli.manifest);
+    if (!manifest) {
+      error = "cannot read manifest " + cli.manifest.string();
+      return false;
+    }
+    // Blank lines and # comments are skipped
+    std::string line;
+    while (std::getline(manifest, line)) {
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if (!line.empty() && line[0] != '#')
+        inputs.push_back(line);
+    }
+  }
+
+  std::vector<fs::path> expanded;
+  for (const auto &input : inputs) {
+    if (!expandInput(input, expanded)) {
+      error = "no such input: " + input;
+      return false;
+    }
+  }
+
+  std::set<fs::path> seen;
+  files.clear();
+  for (auto &file : expanded) {
+    if (seen.insert(fs::weakly_canonical(file)).second)
+      files.push_back(file);
+  }
+  return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "cipher_profile.hpp"
+#include "jpeg.hpp"
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// How saved files are laid out and what is reported about them
+struct OutputOptions {
+  unsigned restartInterval = 0; // RST spacing in MCUs, 0 = none
+  Jpeg::HuffmanMode huffmanMode = Jpeg::HuffmanMode::Standard;
+  Jpeg::ScanMode scanMode = Jpeg::ScanMode::Source;
+  bool scanReport = false; // log per-scan decode times of every input
+};
+
+// Parsed command line: `MyJPEGApp <command> [options] [inputs...]`
+struct CommandLine {
+  // encrypt, decrypt, reencrypt, verify, bench, keygen or serve
+  std::string command;
+
+  // Files, directories (their regular files), glob patterns in the file
+  // name part, or "-" for stdin -> stdout
+  std::vector<std::string> inputs;
+  std::filesystem::path manifest; // file listing one input per line
+
+  std::filesystem::path outDir = ".";
+  std::filesystem::path keyFile = "master_key.txt";
+  std::filesystem::path newKeyFile; // reencrypt: key to rotate to
+  unsigned threads = 0; // 0 = one per hardware thread
+  unsigned memoryLimit = 0; // MiB of coefficients an image keeps in RAM,
+                            // 0 = no limit
+  unsigned memoryBudget = 0; // MiB for all images in flight, 0 = no budget
+  unsigned queueDepth = 4; // images buffered between pipeline stages
+  CipherProfile profile; // stages and rounds for encryption
+  // bench: every profile of a comma-separated --profile list in turn
+  // ("all" stands for each level)
+  std::vector<CipherProfile> benchProfiles;
+  // Pixel rectangles the cipher is limited to, empty = whole image
+  std::vector<Jpeg::Region> regions;
+  bool force = false;   // keygen: overwrite an existing key
+  bool frames = false;  // encrypt/decrypt: inputs are MJPEG or AVI streams
+  // serve: where to listen; encrypt/decrypt: hand the work to that daemon
+  std::filesystem::path socket;
+  OutputOptions output;
+};
+
+// Parse argv; on failure returns false with a message in `error`
+bool parseCommandLine(int argc, char **argv, CommandLine &cli,
+                      std::string &error);
+
+void printUsage(std::ostream &out);
+
+// Expand the inputs and manifest into a list of files, in order and
+// without duplicates; returns false (with `error`) if an input matches
+// nothing
+bool collectInputs(const CommandLine &cli,
+                   std::vector<std::filesystem::path> &files,
+                   std::string &error);
@@ -0,0 +1,218 @@
+#include "coefficient_dump.hpp"
+#include <cstring>
+
+namespace {
+
+const char dumpMagic[6] = {'J', 'C', 'D', 'U', 'M', 'P'};
+const uint16_t dumpVersion = 1;
+const uint16_t byteOrderMark = 0x0102;
+
+void put(std::vector<uint8_t> &out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i)
+    out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+// Bounds-checked little-endian reads over the header bytes
+struct Reader {
+  const uint8_t *data;
+  size_t size;
+  size_t offset = 0;
+
+  bool has(size_t bytes) const { return size - offset >= bytes; }
+
+  uint64_t get(int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+      value |= uint64_t(data[offset + i]) << (8 * i);
+    offset += bytes;
+    return value;
+  }
+};
+
+int tableMask(const bool (&present)[4]) {
+  int mask = 0;
+  for (int t = 0; t < 4; ++t)
+    mask |= present[t] ? 1 << t : 0;
+  return mask;
+}
+
+int tableMask(const CoefficientDumpHeader::HuffmanTable (&tables)[4]) {
+  int mask = 0;
+  for (int t = 0; t < 4; ++t)
+    mask |= tables[t].present ? 1 << t : 0;
+  return mask;
+}
+
+bool readHuffman(Reader &in, int mask,
+                 CoefficientDumpHeader::HuffmanTable (&tables)[4]) {
+  for (int t = 0; t < 4; ++t) {
+    if (!(mask & (1 << t)))
+      continue;
+    auto &table = tables[t];
+    if (!in.has(16))
+      return false;
+    size_t symbols = 0;
+    for (int length = 0; length < 16; ++length) {
+      table.counts[length] = static_cast<uint8_t>(in.get(1));
+      symbols += table.counts[length];
+    }
+    if (symbols > 256 || !in.has(symbols))
+      return false;
+    table.symbols.assign(in.data + in.offset, in.data + in.offset + symbols);
+    in.offset += symbols;
+    table.present = true;
+  }
+  return true;
+}
+
+} // namespace
+
+bool isCoefficientDump(const uint8_t *data, size_t size) {
+  return data && size >= sizeof(dumpMagic) &&
+         std::memcmp(data, dumpMagic, sizeof(dumpMagic)) == 0;
+}
+
+std::vector<uint8_t>
+formatCoefficientDump(CoefficientDumpHeader &header) {
+  std::vector<uint8_t> out(dumpMagic, dumpMagic + sizeof(dumpMagic));
+  put(out, dumpVersion, 2);
+  out.resize(out.size() + 2);
+  std::memcpy(out.data() + out.size() - 2, &byteOrderMark, 2); // host order
+  put(out, header.width, 4);
+  put(out, header.height, 4);
+  put(out, header.components.size(), 2);
+  put(out, header.progressive ? 1 : 0, 1);
+  put(out, 0, 1);
+  put(out, tableMask(header.quantPresent), 1);
+  put(out, tableMask(header.dcTables), 1);
+  put(out, tableMask(header.acTables), 1);
+  put(out, 0, 1);
+  put(out, header.tag.size(), 4);
+
+  // Component records are patched once the plane offsets are known
+  const size_t componentsAt = out.size();
+  out.resize(out.size() + header.components.size() * 20);
+
+  for (int t = 0; t < 4; ++t) {
+    if (header.quantPresent[t])
+      for (uint16_t value : header.quantTables[t])
+        put(out, value, 2);
+  }
+  for (const auto *tables : {&header.dcTables, &header.acTables}) {
+    for (const auto &table : *tables) {
+      if (!table.present)
+        continue;
+      out.insert(out.end(), table.counts, table.counts + 16);
+      out.insert(out.end(), table.symbols.begin(), table.symbols.end());
+    }
+  }
+  out.insert(out.end(), header.tag.begin(), header.tag.end());
+
+  uint64_t offset = out.size();
+  std::vector<uint8_t> records;
+  for (auto &comp : header.components) {
+    offset = (offset + dumpPlaneAlignment - 1) / dumpPlaneAlignment *
+             dumpPlaneAlignment;
+    comp.planeOffset = offset;
+    offset += uint64_t(comp.widthInBlocks) * comp.heightInBlocks * 64 *
+              sizeof(int16_t);
+    put(records, comp.id, 1);
+    put(records, comp.hSampling, 1);
+    put(records, comp.vSampling, 1);
+    put(records, comp.quantTable, 1);
+    put(records, comp.widthInBlocks, 4);
+    put(records, comp.heightInBlocks, 4);
+    put(records, comp.planeOffset, 8);
+  }
+  std::memcpy(out.data() + componentsAt, records.data(), records.size());
+  return out;
+}
+
+bool parseCoefficientDump(const uint8_t *data, size_t size,
+                          CoefficientDumpHeader &header, std::string &error) {
+  header = CoefficientDumpHeader();
+  Reader in{data, size};
+  if (!isCoefficientDump(data, size) || !in.has(30)) {
+    error = "not a coefficient dump";
+    return false;
+  }
+  in.offset = sizeof(dumpMagic);
+  if (in.get(2) != dumpVersion) {
+    error = "unsupported dump version";
+    return false;
+  }
+  uint16_t mark;
+  std::memcpy(&mark, data + in.offset, 2);
+  in.offset += 2;
+  if (mark != byteOrderMark) {
+    error = "dump written with the other byte order";
+    return false;
+  }
+  header.width = static_cast<uint32_t>(in.get(4));
+  header.height = static_cast<uint32_t>(in.get(4));
+  const size_t components = static_cast<size_t>(in.get(2));
+  header.progressive = in.get(1) != 0;
+  in.get(1);
+  const int quantMask = static_cast<int>(in.get(1));
+  const int dcMask = static_cast<int>(in.get(1));
+  const int acMask = static_cast<int>(in.get(1));
+  in.get(1);
+  const size_t tagLength = static_cast<size_t>(in.get(4));
+
+  if (components < 1 || components > 4 || !in.has(components * 20)) {
+    error = "bad component count";
+    return false;
+  }
+  for (size_t i = 0; i < components; ++i) {
+    CoefficientDumpHeader::Component comp;
+    comp.id = static_cast<int>(in.get(1));
+    comp.hSampling = static_cast<int>(in.get(1));
+    comp.vSampling = static_cast<int>(in.get(1));
+    comp.quantTable = static_cast<int>(in.get(1));
+    comp.widthInBlocks = static_cast<uint32_t>(in.get(4));
+    comp.heightInBlocks = static_cast<uint32_t>(in.get(4));
+    comp.planeOffset = in.get(8);
+    header.components.push_back(comp);
+  }
+
+  for (int t = 0; t < 4; ++t) {
+    if (!(quantMask & (1 << t)))
+      continue;
+    if (!in.has(128)) {
+      error = "truncated quantization tables";
+      return false;
+    }
+    for (uint16_t &value : header.quantTables[t])
+      value = static_cast<uint16_t>(in.get(2));
+    header.quantPresent[t] = true;
+  }
+  if (!readHuffman(in, dcMask, header.dcTables) ||
+      !readHuffman(in, acMask, header.acTables)) {
+    error = "truncated Huffman tables";
+    return false;
+  }
+  if (!in.has(tagLength)) {
+    error = "truncated tag";
+    return false;
+  }
+  header.tag.assign(reinterpret_cast<const char *>(data + in.offset),
+                    tagLength);
+  in.offset += tagLength;
+
+  // Planes must be aligned and lie within the file, after the header
+  for (const auto &comp : header.components) {
+    uint64_t bytes = uint64_t(comp.widthInBlocks) * comp.heightInBlocks * 64 *
+                     sizeof(int16_t);
+    if (comp.widthInBlocks == 0 || comp.heightInBlocks == 0 ||
+        comp.hSampling < 1 || comp.hSampling > 4 || comp.vSampling < 1 ||
+        comp.vSampling > 4 || comp.quantTable > 3 ||
+        !header.quantPresent[comp.quantTable] ||
+        comp.planeOffset % dumpPlaneAlignment != 0 ||
+        comp.planeOffset < in.offset || comp.planeOffset > size ||
+        bytes > size - comp.planeOffset) {
+      error = "bad component plane";
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Coefficient dump (.jcd): the quantized DCT coefficients of a JPEG image
+// with the tables needed to encode them again. Loading one costs a file
+// mapping instead of a Huffman decode, so repeated runs over a corpus skip
+// entropy coding entirely. Layout (little-endian):
+//
+//   "JCDUMP" u16 version  u16 byte-order mark (0x0102 as written)
+//   u32 width  u32 height  u16 components  u8 progressive  u8 reserved
+//   u8 quant table mask  u8 DC table mask  u8 AC table mask  u8 reserved
+//   u32 tag length
+//   per component: u8 id, h and v sampling, quant table; u32 width and
+//     height in blocks; u64 plane offset
+//   quant tables in the mask: 64 u16 in natural order
+//   Huffman tables in the masks (DC first): 16 u8 code counts, then the
+//     symbols
+//   tag bytes
+//   block planes, each starting on a dumpPlaneAlignment boundary: one per
+//     component, block rows top to bottom, 64 int16 per block
+//
+// The planes hold the host's int16 as is; the byte-order mark tells a dump
+// from a machine of the other byte order, which is refused.
+struct CoefficientDumpHeader {
+  struct Component {
+    int id = 0;
+    int hSampling = 1;
+    int vSampling = 1;
+    int quantTable = 0;
+    uint32_t widthInBlocks = 0;
+    uint32_t heightInBlocks = 0;
+    uint64_t planeOffset = 0; // set by formatCoefficientDump
+  };
+  struct HuffmanTable {
+    bool present = false;
+    uint8_t counts[16] = {}; // codes of each length 1..16
+    std::vector<uint8_t> symbols;
+  };
+
+  uint32_t width = 0;
+  uint32_t height = 0;
+  bool progressive = false; // the source was; saving keeps the scan mode
+  std::vector<Component> components;
+  bool quantPresent[4] = {};
+  uint16_t quantTables[4][64] = {};
+  HuffmanTable dcTables[4];
+  HuffmanTable acTables[4];
+  std::string tag;
+};
+
+// Planes start on this boundary so blocks never straddle cache lines
+const size_t dumpPlaneAlignment = 64;
+
+// Whether the bytes start with a dump's magic
+bool isCoefficientDump(const uint8_t *data, size_t size);
+
+// Serialize the header and set every component's plane offset; the planes
+// follow the returned bytes, padded up to the first offset
+std::vector<uint8_t> formatCoefficientDump(CoefficientDumpHeader &header);
+
+// Parse the header of a complete dump of `size` bytes and check that every
+// plane lies within it; false with a message in `error`
+bool parseCoefficientDump(const uint8_t *data, size_t size,
+                          CoefficientDumpHeader &header, std::string &error);
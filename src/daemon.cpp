@@ -0,0 +1,463 @@
+#include "daemon.hpp"
+#include <iostream>
+
+#ifdef _WIN32
+
+int runDaemon(const std::filesystem::path &, const DaemonHandler &) {
+  std::cerr << "[ERROR] serve needs Unix domain sockets, which this "
+               "platform does not support\n";
+  return 1;
+}
+
+bool daemonRequest(const std::filesystem::path &, StageGraph::Direction,
+                   const std::filesystem::path &,
+                   const std::filesystem::path &, std::string &error) {
+  error = "Unix domain sockets are not supported on this platform";
+  return false;
+}
+
+#else
+
+#include "file_io.hpp"
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <set>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct MessageHeader {
+  char magic[4];
+  uint8_t code;
+  uint8_t reserved[3];
+  uint64_t length;
+};
+static_assert(sizeof(MessageHeader) == 16, "header is 16 bytes on the wire");
+
+const char messageMagic[4] = {'J', 'C', 'D', '1'};
+const uint64_t maxPayload = uint64_t(1) << 32; // refuse larger requests
+const int maxPassedFds = 2;
+
+// Write end of the pipe the signal handler wakes the accept loop with
+int stopPipe = -1;
+
+void onStopSignal(int) {
+  char byte = 0;
+  ssize_t ignored = write(stopPipe, &byte, 1);
+  (void)ignored;
+}
+
+bool sendAll(int fd, const void *data, size_t size) {
+  auto *bytes = static_cast<const uint8_t *>(data);
+  while (size > 0) {
+    ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+// Same for descriptors that may not be sockets (the passed output file)
+bool writeAllFd(int fd, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool recvAll(int fd, void *data, size_t size) {
+  auto *bytes = static_cast<uint8_t *>(data);
+  while (size > 0) {
+    ssize_t got = recv(fd, bytes, size, 0);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return false;
+    bytes += got;
+    size -= got;
+  }
+  return true;
+}
+
+// Receive a header and any descriptors passed with it. Returns false at
+// end of stream or on error (no descriptors are left open then).
+bool recvHeader(int fd, MessageHeader &header, std::vector<int> &fds) {
+  fds.clear();
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * maxPassedFds)];
+  iovec iov{&header, sizeof(header)};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t got;
+  do {
+    got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (got < 0 && errno == EINTR);
+  if (got <= 0)
+    return false;
+
+  for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; ++i) {
+      int passed;
+      memcpy(&passed, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      fds.push_back(passed);
+    }
+  }
+
+  bool ok = !(msg.msg_flags & MSG_CTRUNC) &&
+            recvAll(fd, reinterpret_cast<uint8_t *>(&header) + got,
+                    sizeof(header) - got);
+  if (!ok) {
+    for (int passed : fds)
+      close(passed);
+    fds.clear();
+  }
+  return ok;
+}
+
+bool sendResponse(int fd, bool success, const uint8_t *body, size_t size) {
+  MessageHeader header{};
+  memcpy(header.magic, messageMagic, sizeof(header.magic));
+  header.code = success ? 0 : 1;
+  header.length = size;
+  return sendAll(fd, &header, sizeof(header)) &&
+         (size == 0 || sendAll(fd, body, size));
+}
+
+bool sendError(int fd, const std::string &message) {
+  return sendResponse(fd, false,
+                      reinterpret_cast<const uint8_t *>(message.data()),
+                      message.size());
+}
+
+// Read everything behind a passed descriptor: mapped when it is a regular
+// file, read to its end otherwise (a pipe)
+bool readPassed(int fd, MappedFile &mapped, std::vector<uint8_t> &buffer,
+                const uint8_t *&data, size_t &size) {
+  if (mapped.openDescriptor(fd)) {
+    data = mapped.data();
+    size = mapped.size();
+    return true;
+  }
+  buffer.clear();
+  uint8_t chunk[64 * 1024];
+  ssize_t got;
+  while ((got = read(fd, chunk, sizeof(chunk))) != 0) {
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      return false;
+    buffer.insert(buffer.end(), chunk, chunk + got);
+  }
+  data = buffer.data();
+  size = buffer.size();
+  return true;
+}
+
+// Serve one request of a connection. Returns false when the connection
+// is to be closed: at its end, or after a request that breaks the protocol.
+bool serveRequest(int client, const DaemonHandler &handler,
+                  std::vector<uint8_t> &payload, std::vector<uint8_t> &output) {
+  MessageHeader header;
+  std::vector<int> fds;
+  if (!recvHeader(client, header, fds))
+    return false;
+
+  // Passed descriptors are closed on every path out
+  struct Closer {
+    std::vector<int> &fds;
+    ~Closer() {
+      for (int fd : fds)
+        close(fd);
+    }
+  } closer{fds};
+
+  if (memcmp(header.magic, messageMagic, sizeof(header.magic)) != 0 ||
+      (header.code != 'E' && header.code != 'D')) {
+    sendError(client, "malformed request header");
+    return false;
+  }
+  if (fds.size() > 0 && header.length != 0) {
+    sendError(client, "a request passing a descriptor has no payload");
+    return false;
+  }
+  if (header.length > maxPayload) {
+    sendError(client, "payload too large");
+    return false;
+  }
+
+  MappedFile mapped;
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  if (fds.empty()) {
+    payload.resize(header.length);
+    if (!recvAll(client, payload.data(), payload.size()))
+      return false;
+    data = payload.data();
+    size = payload.size();
+  } else if (!readPassed(fds[0], mapped, payload, data, size)) {
+    return sendError(client, "cannot read the passed input descriptor");
+  }
+
+  std::string error;
+  const StageGraph::Direction direction =
+      header.code == 'D' ? StageGraph::Direction::Decrypt
+                         : StageGraph::Direction::Encrypt;
+  if (!handler(direction, data, size, output, error))
+    return sendError(client, error);
+
+  if (fds.size() > 1) {
+    if (!writeAllFd(fds[1], output.data(), output.size()))
+      return sendError(client, "cannot write the passed output descriptor");
+    return sendResponse(client, true, nullptr, 0);
+  }
+  return sendResponse(client, true, output.data(), output.size());
+}
+
+// Listening socket bound to `path`, or -1. A socket file left behind by
+// a daemon that is gone is replaced; one that still answers is not.
+int listenOn(const fs::path &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  const std::string name = path.string();
+  if (name.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "[ERROR] Socket path too long: " << name << "\n";
+    return -1;
+  }
+  memcpy(addr.sun_path, name.c_str(), name.size() + 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    std::cerr << "[ERROR] socket: " << strerror(errno) << "\n";
+    return -1;
+  }
+  if (fs::exists(fs::symlink_status(path))) {
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0) {
+      std::cerr << "[ERROR] A daemon is already listening on " << name << "\n";
+      close(fd);
+      return -1;
+    }
+    unlink(name.c_str());
+  }
+
+  // Whoever can connect can use the key, so only the owner may
+  mode_t previous = umask(0177);
+  int bound = bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+  umask(previous);
+  if (bound != 0 || listen(fd, SOMAXCONN) != 0) {
+    std::cerr << "[ERROR] Cannot listen on " << name << ": "
+              << strerror(errno) << "\n";
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+} // namespace
+
+int runDaemon(const fs::path &socketPath, const DaemonHandler &handler) {
+  int wake[2];
+  if (pipe2(wake, O_CLOEXEC) != 0) {
+    std::cerr << "[ERROR] pipe: " << strerror(errno) << "\n";
+    return 1;
+  }
+  int listener = listenOn(socketPath);
+  if (listener < 0) {
+    close(wake[0]);
+    close(wake[1]);
+    return 1;
+  }
+
+  stopPipe = wake[1];
+  struct sigaction action {};
+  action.sa_handler = onStopSignal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN); // a vanished client must not end the daemon
+
+  std::cout << "[INFO] Listening on " << socketPath.string() << std::endl;
+
+  // Open connections, so shutdown can end the ones waiting for requests
+  std::mutex mutex;
+  std::condition_variable idle;
+  std::set<int> clients;
+
+  pollfd waits[2] = {{listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+  while (true) {
+    if (poll(waits, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "[ERROR] poll: " << strerror(errno) << "\n";
+      break;
+    }
+    if (waits[1].revents)
+      break;
+    if (!(waits[0].revents & POLLIN))
+      continue;
+
+    int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0)
+      continue;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      clients.insert(client);
+    }
+    std::thread([client, &handler, &mutex, &idle, &clients]() {
+      // Buffers reused by every request of the connection
+      std::vector<uint8_t> payload, output;
+      while (serveRequest(client, handler, payload, output)) {
+      }
+      close(client);
+      std::lock_guard<std::mutex> lock(mutex);
+      clients.erase(client);
+      idle.notify_all();
+    }).detach();
+  }
+
+  // Stop taking connections, let requests in flight finish
+  close(listener);
+  unlink(socketPath.string().c_str());
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (int client : clients)
+      shutdown(client, SHUT_RD);
+    idle.wait(lock, [&clients]() { return clients.empty(); });
+  }
+  close(wake[0]);
+  close(wake[1]);
+  std::cout << "[INFO] Daemon stopped" << std::endl;
+  return 0;
+}
+
+bool daemonRequest(const fs::path &socketPath,
+                   StageGraph::Direction direction, const fs::path &input,
+                   const fs::path &output, std::string &error) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  const std::string name = socketPath.string();
+  if (name.size() >= sizeof(addr.sun_path)) {
+    error = "socket path too long";
+    return false;
+  }
+  memcpy(addr.sun_path, name.c_str(), name.size() + 1);
+
+  // The daemon reads the input only after the output exists, so they must
+  // not be the same file
+  std::error_code ec;
+  if (fs::equivalent(input, output, ec)) {
+    error = "output would replace the input";
+    return false;
+  }
+
+  int in = open(input.string().c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    error = "cannot open " + input.string();
+    return false;
+  }
+  // Written under a temporary name, renamed into place on success only
+  fs::path partFile = output;
+  partFile += ".part";
+  int out = open(partFile.string().c_str(),
+                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    close(in);
+    error = "cannot create " + partFile.string();
+    return false;
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool ok = sock >= 0 && connect(sock, reinterpret_cast<sockaddr *>(&addr),
+                                 sizeof(addr)) == 0;
+  if (!ok)
+    error = "no daemon listening on " + name;
+
+  if (ok) {
+    MessageHeader header{};
+    memcpy(header.magic, messageMagic, sizeof(header.magic));
+    header.code = direction == StageGraph::Direction::Decrypt ? 'D' : 'E';
+
+    int fds[2] = {in, out};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov{&header, sizeof(header)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    ssize_t sent;
+    do {
+      sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    ok = sent == static_cast<ssize_t>(sizeof(header));
+
+    MessageHeader response;
+    std::vector<int> unexpected;
+    ok = ok && recvHeader(sock, response, unexpected) &&
+         memcmp(response.magic, messageMagic, sizeof(response.magic)) == 0;
+    for (int fd : unexpected)
+      close(fd);
+    if (!ok) {
+      error = "daemon closed the connection";
+    } else {
+      std::string body(response.length, '\0');
+      ok = recvAll(sock, &body[0], body.size());
+      if (!ok)
+        error = "daemon closed the connection";
+      else if (response.code != 0) {
+        error = body;
+        ok = false;
+      }
+    }
+  }
+
+  if (sock >= 0)
+    close(sock);
+  close(in);
+  if (close(out) != 0 && ok) {
+    error = "cannot write " + partFile.string();
+    ok = false;
+  }
+  if (ok) {
+    fs::rename(partFile, output, ec);
+    if (ec) {
+      error = "cannot create " + output.string();
+      ok = false;
+    }
+  }
+  if (!ok)
+    unlink(partFile.string().c_str());
+  return ok;
+}
+
+#endif
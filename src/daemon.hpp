@@ -0,0 +1,44 @@
+#pragma once
+#include "stage_graph.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Local encryption daemon on a Unix domain socket (POSIX only; elsewhere
+// both calls fail with an error message).
+//
+// Every message starts with a 16 byte header in native byte order:
+//   char     magic[4]  "JCD1"
+//   uint8_t  code      request: 'E' encrypt, 'D' decrypt
+//                      response: 0 success, 1 failure
+//   uint8_t  reserved[3]
+//   uint64_t length    bytes following the header
+//
+// A request either carries the JPEG as its payload, or passes it as a
+// file descriptor with SCM_RIGHTS alongside the header (length 0). A
+// second descriptor, if passed, receives the output instead of the
+// response. The response carries the output JPEG (empty when it went to
+// the output descriptor) or, on failure, an error message. A connection
+// may send any number of requests, one after the other.
+
+// Transform one JPEG in memory; false with a message in `error`
+using DaemonHandler = std::function<bool(
+    StageGraph::Direction direction, const uint8_t *data, size_t size,
+    std::vector<uint8_t> &out, std::string &error)>;
+
+// Serve requests on `socketPath` until SIGINT or SIGTERM; each connection
+// runs on its own thread. Returns the process exit code.
+int runDaemon(const std::filesystem::path &socketPath,
+              const DaemonHandler &handler);
+
+// Have the daemon at `socketPath` transform `input` into `output`, passing
+// both files as descriptors. The output is written as `output`.part and
+// renamed into place only on success; an output that is the input itself
+// is refused. False with a message in `error`.
+bool daemonRequest(const std::filesystem::path &socketPath,
+                   StageGraph::Direction direction,
+                   const std::filesystem::path &input,
+                   const std::filesystem::path &output, std::string &error);
@@ -0,0 +1,134 @@
+#include "file_io.hpp"
+#include <filesystem>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+FILE *openFile(const std::wstring &path, const wchar_t *mode) {
+#ifdef _WIN32
+  return _wfopen(path.c_str(), mode);
+#else
+  std::wstring wideMode(mode);
+  return fopen(std::filesystem::path(path).string().c_str(),
+               std::string(wideMode.begin(), wideMode.end()).c_str());
+#endif
+}
+
+void setBinaryMode(FILE *stream) {
+#ifdef _WIN32
+  _setmode(_fileno(stream), _O_BINARY);
+#else
+  (void)stream;
+#endif
+}
+
+bool readAll(FILE *stream, std::vector<uint8_t> &out) {
+  out.clear();
+  uint8_t chunk[64 * 1024];
+  size_t got;
+  while ((got = fread(chunk, 1, sizeof(chunk), stream)) > 0)
+    out.insert(out.end(), chunk, chunk + got);
+  return !ferror(stream);
+}
+
+bool writeAll(FILE *stream, const std::vector<uint8_t> &data) {
+  if (fwrite(data.data(), 1, data.size(), stream) != data.size())
+    return false;
+  return fflush(stream) == 0;
+}
+
+MappedFile::~MappedFile() { close(); }
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::wstring &path, bool copyOnWrite) {
+  close();
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+
+  mapping = CreateFileMappingW(file, nullptr,
+                               copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY,
+                               0, 0, nullptr);
+  CloseHandle(file); // the mapping keeps the file open
+  if (!mapping)
+    return false;
+
+  void *view = MapViewOfFile(
+      mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    CloseHandle(mapping);
+    mapping = nullptr;
+    return false;
+  }
+
+  bytes = static_cast<const uint8_t *>(view);
+  length = static_cast<size_t>(fileSize.QuadPart);
+  return true;
+}
+
+void MappedFile::close() {
+  if (bytes)
+    UnmapViewOfFile(bytes);
+  if (mapping)
+    CloseHandle(mapping);
+  bytes = nullptr;
+  mapping = nullptr;
+  length = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::wstring &path, bool copyOnWrite) {
+  close();
+  int fd = ::open(std::filesystem::path(path).string().c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool mapped = openDescriptor(fd, copyOnWrite);
+  ::close(fd); // the mapping keeps the file open
+  return mapped;
+}
+
+bool MappedFile::openDescriptor(int fd, bool copyOnWrite) {
+  close();
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0)
+    return false;
+
+  void *view = mmap(nullptr, info.st_size,
+                    copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ,
+                    MAP_PRIVATE, fd, 0);
+  if (view == MAP_FAILED)
+    return false;
+
+  madvise(view, info.st_size, MADV_SEQUENTIAL);
+  bytes = static_cast<const uint8_t *>(view);
+  length = static_cast<size_t>(info.st_size);
+  return true;
+}
+
+void MappedFile::close() {
+  if (bytes)
+    munmap(const_cast<uint8_t *>(bytes), length);
+  bytes = nullptr;
+  length = 0;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdio.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// fopen for wide paths on every platform
+FILE *openFile(const std::wstring &path, const wchar_t *mode);
+
+// Put a standard stream (stdin/stdout) into binary mode; only Windows
+// translates line endings, elsewhere this does nothing
+void setBinaryMode(FILE *stream);
+
+// Read a stream to its end into `out`; false on a read error
+bool readAll(FILE *stream, std::vector<uint8_t> &out);
+
+// Write every byte and flush; false on a write error
+bool writeAll(FILE *stream, const std::vector<uint8_t> &data);
+
+// Memory mapping of a whole file. The mapping is advised for sequential
+// access, so the kernel reads ahead and pages stay shared in the page
+// cache between workers reading the same files. A copy-on-write mapping
+// may also be written: changed pages become private to the process and
+// never reach the file.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // Map the file, read-only unless `copyOnWrite`; returns false if it
+  // cannot be mapped (missing, empty, not a regular file)
+  bool open(const std::wstring &path, bool copyOnWrite = false);
+
+#ifndef _WIN32
+  // Map the file behind an open descriptor, which stays owned by the
+  // caller; same failures as open()
+  bool openDescriptor(int fd, bool copyOnWrite = false);
+#endif
+
+  // Unmap (also done by the destructor)
+  void close();
+
+  const uint8_t *data() const { return bytes; }
+  // Only for copy-on-write mappings
+  uint8_t *writableData() { return const_cast<uint8_t *>(bytes); }
+  size_t size() const { return length; }
+
+private:
+  const uint8_t *bytes = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  void *mapping = nullptr;
+#endif
+};
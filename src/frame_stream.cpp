@@ -0,0 +1,569 @@
+#include "frame_stream.hpp"
+#include "file_io.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum class FrameEnd { Complete, Incomplete, Malformed };
+
+// Find the end (just past EOI) of the frame whose SOI starts `data`
+FrameEnd findFrameEnd(const uint8_t *data, size_t size, size_t &end) {
+  size_t pos = 2; // past SOI
+  while (true) {
+    if (pos >= size)
+      return FrameEnd::Incomplete;
+    if (data[pos] != 0xFF)
+      return FrameEnd::Malformed;
+    while (pos < size && data[pos] == 0xFF) // fill bytes
+      ++pos;
+    if (pos >= size)
+      return FrameEnd::Incomplete;
+    const uint8_t code = data[pos++];
+    if (code == 0xD9) {
+      end = pos;
+      return FrameEnd::Complete;
+    }
+    if (code == 0xD8 || code == 0x00)
+      return FrameEnd::Malformed;
+    if ((code >= 0xD0 && code <= 0xD7) || code == 0x01)
+      continue; // RSTn and TEM carry no length
+
+    if (pos + 2 > size)
+      return FrameEnd::Incomplete;
+    const size_t length = (size_t(data[pos]) << 8) | data[pos + 1];
+    if (length < 2)
+      return FrameEnd::Malformed;
+    pos += length;
+    if (code != 0xDA)
+      continue;
+
+    // Entropy-coded data runs up to the next marker that is neither a
+    // stuffed zero nor a restart marker
+    while (true) {
+      if (pos >= size)
+        return FrameEnd::Incomplete;
+      const void *ff = memchr(data + pos, 0xFF, size - pos);
+      if (!ff)
+        return FrameEnd::Incomplete;
+      pos = static_cast<const uint8_t *>(ff) - data;
+      if (pos + 1 >= size)
+        return FrameEnd::Incomplete;
+      const uint8_t next = data[pos + 1];
+      if (next == 0x00 || (next >= 0xD0 && next <= 0xD7))
+        pos += 2;
+      else if (next == 0xFF)
+        ++pos;
+      else
+        break;
+    }
+  }
+}
+
+// Offset of the next SOI (FF D8 FF) at or after `from`, or npos
+size_t findSoi(const std::vector<uint8_t> &buffer, size_t from) {
+  for (size_t i = from; i + 3 <= buffer.size(); ++i) {
+    const void *ff = memchr(buffer.data() + i, 0xFF, buffer.size() - i);
+    if (!ff)
+      break;
+    i = static_cast<const uint8_t *>(ff) - buffer.data();
+    if (i + 3 <= buffer.size() && buffer[i + 1] == 0xD8 &&
+        buffer[i + 2] == 0xFF)
+      return i;
+  }
+  return std::string::npos;
+}
+
+// One frame between the source and the sink
+struct PendingFrame {
+  std::vector<uint8_t> prefix; // bytes before the frame, copied as they are
+  std::vector<uint8_t> input;  // frame bytes, when not borrowed
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  size_t index = 0;
+  std::vector<uint8_t> output;
+  int width = 0, height = 0;
+  double ms = 0;
+  bool ok = false;
+  std::atomic<bool> done{false};
+};
+using FramePtr = std::shared_ptr<PendingFrame>;
+
+// Pull frames from `source` (nullptr at the end), transform them on the
+// pool with at most `window` in flight, and hand them to `sink` in order
+// on the calling thread, which helps the pool while it waits
+bool runOrdered(const std::function<FramePtr()> &source,
+                const FrameTransform &transform,
+                const std::function<bool(PendingFrame &)> &sink,
+                ThreadPool &pool, size_t window, FrameStreamStats &stats,
+                std::string &error) {
+  auto waitFor = [&pool](const PendingFrame &frame) {
+    pool.helpUntil([&frame]() {
+      return frame.done.load(std::memory_order_acquire);
+    });
+  };
+
+  std::deque<FramePtr> inFlight;
+  bool more = true, ok = true;
+  while (ok && (more || !inFlight.empty())) {
+    while (more && inFlight.size() < std::max<size_t>(window, 1)) {
+      FramePtr frame = source();
+      if (!frame) {
+        more = false;
+        break;
+      }
+      frame->index = stats.frames + inFlight.size();
+      inFlight.push_back(frame);
+      pool.submit([frame, &transform]() {
+        auto start = Clock::now();
+        frame->ok = transform(frame->data, frame->size, frame->output,
+                              frame->width, frame->height);
+        frame->ms = std::chrono::duration<double, std::milli>(Clock::now() -
+                                                              start)
+                        .count();
+        frame->done.store(true, std::memory_order_release);
+      });
+    }
+    if (inFlight.empty())
+      break;
+
+    PendingFrame &frame = *inFlight.front();
+    waitFor(frame);
+    if (!frame.ok) {
+      error = "frame " + std::to_string(frame.index) + " failed";
+      ok = false;
+      break;
+    }
+    auto &resolution = stats.resolutions[{frame.width, frame.height}];
+    ++resolution.frames;
+    resolution.transformMs += frame.ms;
+    ++stats.frames;
+    stats.inputBytes += frame.prefix.size() + frame.size;
+    stats.outputBytes += frame.prefix.size() + frame.output.size();
+    if (!sink(frame)) {
+      ok = false;
+      break;
+    }
+    inFlight.pop_front();
+  }
+
+  // The tasks use `transform`, so none may outlive this call
+  for (const auto &frame : inFlight)
+    waitFor(*frame);
+  return ok;
+}
+
+bool readExactly(FILE *in, uint8_t *data, size_t size, size_t &got) {
+  got = 0;
+  while (got < size) {
+    size_t n = fread(data + got, 1, size - got, in);
+    if (n == 0)
+      return !ferror(in);
+    got += n;
+  }
+  return true;
+}
+
+bool writeBytes(FILE *out, const uint8_t *data, size_t size) {
+  return size == 0 || fwrite(data, 1, size, out) == size;
+}
+
+// ---------- raw MJPEG ----------
+
+bool transformRaw(FILE *in, FILE *out, std::vector<uint8_t> head,
+                  const FrameTransform &transform, ThreadPool &pool,
+                  size_t window, FrameStreamStats &stats,
+                  std::string &error) {
+  FrameSplitter splitter;
+  splitter.feed(head.data(), head.size());
+  std::vector<uint8_t> chunk(1 << 20);
+  bool eof = false;
+
+  auto source = [&]() -> FramePtr {
+    auto frame = std::make_shared<PendingFrame>();
+    while (true) {
+      if (splitter.next(frame->prefix, frame->input)) {
+        // Bytes outside the frames would pass through untransformed
+        if (!frame->prefix.empty()) {
+          error = "non-JPEG data before frame " +
+                  std::to_string(stats.frames + 1);
+          return nullptr;
+        }
+        frame->data = frame->input.data();
+        frame->size = frame->input.size();
+        return frame;
+      }
+      if (splitter.failed()) {
+        error = "malformed JPEG frame after frame " +
+                std::to_string(stats.frames);
+        return nullptr;
+      }
+      if (eof)
+        return nullptr;
+      size_t got = fread(chunk.data(), 1, chunk.size(), in);
+      if (got == 0) {
+        if (ferror(in))
+          error = "read error";
+        eof = true;
+      }
+      splitter.feed(chunk.data(), got);
+    }
+  };
+
+  // Each frame is flushed, so a live stream stays live
+  auto sink = [&](PendingFrame &frame) {
+    if (!writeBytes(out, frame.prefix.data(), frame.prefix.size()) ||
+        !writeBytes(out, frame.output.data(), frame.output.size()) ||
+        fflush(out) != 0) {
+      error = "write error";
+      return false;
+    }
+    return true;
+  };
+
+  if (!runOrdered(source, transform, sink, pool, window, stats, error))
+    return false;
+  if (!error.empty())
+    return false;
+
+  std::vector<uint8_t> trailing;
+  if (!splitter.finish(trailing)) {
+    error = "stream ends inside a frame";
+    return false;
+  }
+  if (stats.frames == 0) {
+    error = "no JPEG frames in the stream";
+    return false;
+  }
+  if (!trailing.empty()) {
+    error = "non-JPEG data after the last frame";
+    return false;
+  }
+  return true;
+}
+
+// ---------- AVI ----------
+
+uint32_t readLe32(const uint8_t *p) {
+  return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 |
+         uint32_t(p[3]) << 24;
+}
+
+void appendLe32(std::vector<uint8_t> &out, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    out.push_back(uint8_t(value >> (8 * i)));
+}
+
+void patchLe32(std::vector<uint8_t> &out, size_t at, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    out[at + i] = uint8_t(value >> (8 * i));
+}
+
+bool isFourcc(const uint8_t *p, const char *fourcc) {
+  return memcmp(p, fourcc, 4) == 0;
+}
+
+// Rewrites an AVI file with its JPEG video chunks replaced by transformed
+// frames: chunk and list sizes are recomputed and idx1 is rebuilt with
+// the new offsets. OpenDML files (indx super indexes, AVIX extensions)
+// address data by absolute offsets beyond idx1 and are refused.
+class AviRewriter {
+public:
+  AviRewriter(const uint8_t *data, size_t size) : data(data), size(size) {}
+
+  // Locate the frames; false with `error` if the file is not supported
+  bool parse(std::string &error) {
+    if (size < 12 || !isFourcc(data, "RIFF") || !isFourcc(data + 8, "AVI ")) {
+      error = "not an AVI file";
+      return false;
+    }
+    riffEnd = std::min<size_t>(size, 8 + size_t(readLe32(data + 4)));
+    if (riffEnd < size && size - riffEnd >= 12 &&
+        isFourcc(data + riffEnd, "RIFF")) {
+      error = "OpenDML AVI (AVIX) is not supported";
+      return false;
+    }
+    return scan(12, riffEnd, false, error);
+  }
+
+  const std::vector<std::pair<size_t, size_t>> &frames() const {
+    return frameSpans;
+  }
+
+  // Build the output with frame i replaced by outputs[i]
+  bool write(const std::vector<std::vector<uint8_t>> &outputs,
+             std::vector<uint8_t> &out, std::string &error) {
+    out.clear();
+    out.insert(out.end(), data, data + 12);
+    nextFrame = 0;
+    if (!copy(12, riffEnd, outputs, out, error))
+      return false;
+    if (out.size() - 8 > UINT32_MAX) {
+      error = "output exceeds the 4 GB AVI limit";
+      return false;
+    }
+    patchLe32(out, 4, uint32_t(out.size() - 8));
+    out.insert(out.end(), data + riffEnd, data + size); // trailing bytes
+    return true;
+  }
+
+private:
+  // Walk the chunks in [begin, end) noting frames (video chunks holding a
+  // JPEG) and refusing OpenDML structures
+  bool scan(size_t begin, size_t end, bool inMovi, std::string &error) {
+    for (size_t pos = begin; pos + 8 <= end;) {
+      const uint8_t *id = data + pos;
+      const size_t chunkSize = readLe32(id + 4);
+      const size_t body = pos + 8;
+      if (body + chunkSize > end) {
+        error = "truncated AVI chunk";
+        return false;
+      }
+      if (isFourcc(id, "LIST") && chunkSize >= 4) {
+        const uint8_t *type = data + body;
+        if (isFourcc(type, "odml")) {
+          error = "OpenDML AVI (odml) is not supported";
+          return false;
+        }
+        bool movi = isFourcc(type, "movi");
+        if (movi)
+          moviType = body;
+        if (!scan(body + 4, body + chunkSize, inMovi || movi, error))
+          return false;
+      } else if (isFourcc(id, "indx") || (id[0] == 'i' && id[1] == 'x')) {
+        error = "OpenDML AVI (indx, ix##) is not supported";
+        return false;
+      } else if (inMovi && chunkSize >= 2 && data[body] == 0xFF &&
+                 data[body + 1] == 0xD8) {
+        frameSpans.push_back({body, chunkSize});
+      }
+      pos = body + chunkSize + (chunkSize & 1);
+    }
+    return true;
+  }
+
+  // Copy the chunks in [begin, end) to `out`, replacing frames and
+  // rebuilding LIST sizes and idx1
+  bool copy(size_t begin, size_t end,
+            const std::vector<std::vector<uint8_t>> &outputs,
+            std::vector<uint8_t> &out, std::string &error) {
+    for (size_t pos = begin; pos + 8 <= end;) {
+      const uint8_t *id = data + pos;
+      const size_t chunkSize = readLe32(id + 4);
+      const size_t body = pos + 8;
+      const size_t next = body + chunkSize + (chunkSize & 1);
+      const size_t outPos = out.size();
+
+      if (isFourcc(id, "LIST") && chunkSize >= 4) {
+        out.insert(out.end(), id, id + 12); // id, size (patched), type
+        if (body == moviType)
+          newMoviType = outPos + 8;
+        if (!copy(body + 4, body + chunkSize, outputs, out, error))
+          return false;
+        patchLe32(out, outPos + 4, uint32_t(out.size() - outPos - 8));
+      } else if (isFourcc(id, "idx1")) {
+        if (!rebuildIndex(body, chunkSize, out, error))
+          return false;
+      } else if (nextFrame < frameSpans.size() &&
+                 frameSpans[nextFrame].first == body) {
+        const auto &frame = outputs[nextFrame++];
+        out.insert(out.end(), id, id + 4);
+        appendLe32(out, uint32_t(frame.size()));
+        out.insert(out.end(), frame.begin(), frame.end());
+        if (frame.size() & 1)
+          out.push_back(0);
+      } else {
+        out.insert(out.end(), id, data + std::min(next, end));
+      }
+
+      if (moviType && pos > moviType && pos < moviEnd())
+        moved[pos - moviType] = {outPos - newMoviType,
+                                 uint32_t(readLe32(out.data() + outPos + 4))};
+      pos = next;
+    }
+    return true;
+  }
+
+  size_t moviEnd() const {
+    return moviType + readLe32(data + moviType - 4);
+  }
+
+  // idx1 entries (id, flags, offset, size) point at chunks of the movi
+  // list, relative to its type field or (in some writers) to the file
+  bool rebuildIndex(size_t body, size_t chunkSize, std::vector<uint8_t> &out,
+                    std::string &error) {
+    const size_t count = chunkSize / 16;
+    size_t base = 0;
+    if (count > 0) {
+      uint32_t first = readLe32(data + body + 8);
+      if (moved.count(first))
+        base = 0;
+      else if (first >= moviType && moved.count(first - moviType))
+        base = moviType;
+      else {
+        error = "idx1 does not match the movi list";
+        return false;
+      }
+    }
+
+    out.insert(out.end(), data + body - 8, data + body); // id, same size
+    for (size_t i = 0; i < count; ++i) {
+      const uint8_t *entry = data + body + i * 16;
+      auto it = moved.find(readLe32(entry + 8) - base);
+      if (it == moved.end()) {
+        error = "idx1 entry " + std::to_string(i) + " points nowhere";
+        return false;
+      }
+      out.insert(out.end(), entry, entry + 8); // id, flags
+      size_t offset = it->second.first + (base ? newMoviType : 0);
+      appendLe32(out, uint32_t(offset));
+      appendLe32(out, it->second.second);
+    }
+    // Keep any bytes after the last whole entry, padding included
+    size_t tail = chunkSize - count * 16 + (chunkSize & 1);
+    out.insert(out.end(), data + body + count * 16,
+               data + body + count * 16 + tail);
+    return true;
+  }
+
+  const uint8_t *data;
+  size_t size;
+  size_t riffEnd = 0;
+  size_t moviType = 0;    // offset of the movi list's type field
+  size_t newMoviType = 0; // the same in the output
+  std::vector<std::pair<size_t, size_t>> frameSpans; // body offset, size
+  size_t nextFrame = 0;
+  // Chunks of the movi list, by offset from its type field: new offset
+  // from the output's type field and new size
+  std::map<size_t, std::pair<size_t, uint32_t>> moved;
+};
+
+bool transformAvi(FILE *in, FILE *out, std::vector<uint8_t> file,
+                  const FrameTransform &transform, ThreadPool &pool,
+                  size_t window, FrameStreamStats &stats,
+                  std::string &error) {
+  std::vector<uint8_t> rest;
+  if (!readAll(in, rest)) {
+    error = "read error";
+    return false;
+  }
+  file.insert(file.end(), rest.begin(), rest.end());
+  rest = std::vector<uint8_t>();
+
+  AviRewriter avi(file.data(), file.size());
+  if (!avi.parse(error))
+    return false;
+
+  std::vector<std::vector<uint8_t>> outputs(avi.frames().size());
+  size_t next = 0;
+  auto source = [&]() -> FramePtr {
+    if (next == avi.frames().size())
+      return nullptr;
+    auto frame = std::make_shared<PendingFrame>();
+    frame->data = file.data() + avi.frames()[next].first;
+    frame->size = avi.frames()[next].second;
+    ++next;
+    return frame;
+  };
+  auto sink = [&](PendingFrame &frame) {
+    outputs[frame.index] = std::move(frame.output);
+    return true;
+  };
+  if (!runOrdered(source, transform, sink, pool, window, stats, error))
+    return false;
+
+  std::vector<uint8_t> rewritten;
+  if (!avi.write(outputs, rewritten, error))
+    return false;
+  // Sizes cover the frames only; the rest of the container is unchanged
+  // apart from its headers
+  stats.inputBytes = file.size();
+  stats.outputBytes = rewritten.size();
+  if (!writeAll(out, rewritten)) {
+    error = "write error";
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+void FrameSplitter::feed(const uint8_t *data, size_t size) {
+  if (consumed > 0) {
+    buffer.erase(buffer.begin(), buffer.begin() + consumed);
+    consumed = 0;
+  }
+  buffer.insert(buffer.end(), data, data + size);
+}
+
+bool FrameSplitter::next(std::vector<uint8_t> &prefix,
+                         std::vector<uint8_t> &frame) {
+  if (malformed)
+    return false;
+  size_t soi = findSoi(buffer, consumed);
+  if (soi == std::string::npos)
+    return false;
+
+  size_t end = 0;
+  switch (findFrameEnd(buffer.data() + soi, buffer.size() - soi, end)) {
+  case FrameEnd::Incomplete:
+    return false;
+  case FrameEnd::Malformed:
+    malformed = true;
+    return false;
+  case FrameEnd::Complete:
+    break;
+  }
+  prefix.assign(buffer.begin() + consumed, buffer.begin() + soi);
+  frame.assign(buffer.begin() + soi, buffer.begin() + soi + end);
+  consumed = soi + end;
+  return true;
+}
+
+bool FrameSplitter::finish(std::vector<uint8_t> &trailing) {
+  if (malformed || findSoi(buffer, consumed) != std::string::npos)
+    return false;
+  trailing.assign(buffer.begin() + consumed, buffer.end());
+  consumed = buffer.size();
+  return true;
+}
+
+bool transformFrameStream(FILE *in, FILE *out, const FrameTransform &transform,
+                          ThreadPool &pool, size_t window,
+                          FrameStreamStats &stats, std::string &error) {
+  auto start = Clock::now();
+  stats = FrameStreamStats();
+
+  // The first bytes tell the container apart without seeking (in may be
+  // a pipe)
+  std::vector<uint8_t> head(12);
+  size_t got = 0;
+  if (!readExactly(in, head.data(), head.size(), got)) {
+    error = "read error";
+    return false;
+  }
+  head.resize(got);
+
+  bool ok;
+  if (got == 12 && isFourcc(head.data(), "RIFF") &&
+      isFourcc(head.data() + 8, "AVI "))
+    ok = transformAvi(in, out, std::move(head), transform, pool, window,
+                      stats, error);
+  else
+    ok = transformRaw(in, out, std::move(head), transform, pool, window,
+                      stats, error);
+
+  if (ok && stats.frames == 0) {
+    error = "no JPEG frames in the stream";
+    ok = false;
+  }
+  stats.seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  return ok;
+}
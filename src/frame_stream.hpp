@@ -0,0 +1,69 @@
+#pragma once
+#include <stdio.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+class ThreadPool;
+
+// Motion JPEG: streams of JPEG frames, either concatenated (raw MJPEG, as
+// cameras and ffmpeg's mjpeg muxer write them) or as the video chunks of
+// an AVI file. Frames are transformed concurrently and written back in
+// their original order; the AVI structure around them is kept. A raw
+// stream must consist of frames only, and any stream must hold at least
+// one, so nothing passes through untransformed.
+
+// Encrypt or decrypt one frame into `out` and report its size; false
+// stops the stream (a frame is never passed through untransformed)
+using FrameTransform =
+    std::function<bool(const uint8_t *data, size_t size,
+                       std::vector<uint8_t> &out, int &width, int &height)>;
+
+struct FrameStreamStats {
+  struct Resolution {
+    size_t frames = 0;
+    double transformMs = 0; // summed over the frames
+  };
+  size_t frames = 0;
+  size_t inputBytes = 0;
+  size_t outputBytes = 0;
+  double seconds = 0; // wall time of the whole stream
+  std::map<std::pair<int, int>, Resolution> resolutions; // by width, height
+};
+
+// Transform every frame of `in` into `out`: an AVI file (read completely,
+// then rewritten with new chunk sizes and index) or raw MJPEG (streamed,
+// so it works on live pipes). At most `window` frames are in flight.
+// Fails on a stream without frames and on raw bytes outside the frames.
+// Returns false with a message in `error`.
+bool transformFrameStream(FILE *in, FILE *out, const FrameTransform &transform,
+                          ThreadPool &pool, size_t window,
+                          FrameStreamStats &stats, std::string &error);
+
+// Incremental splitter for concatenated JPEG frames. Every frame is
+// delimited by SOI and its EOI, found by walking the marker segments and
+// entropy-coded data, so EXIF thumbnails or FF D9 bytes inside segments do
+// not end a frame early.
+class FrameSplitter {
+public:
+  void feed(const uint8_t *data, size_t size);
+
+  // Next complete frame and the bytes before it; false if more input is
+  // needed. A malformed frame sets failed().
+  bool next(std::vector<uint8_t> &prefix, std::vector<uint8_t> &frame);
+
+  // Bytes left over at the end of the input; false if they hold the
+  // start of an incomplete frame
+  bool finish(std::vector<uint8_t> &trailing);
+
+  bool failed() const { return malformed; }
+
+private:
+  std::vector<uint8_t> buffer;
+  size_t consumed = 0;
+  bool malformed = false;
+};
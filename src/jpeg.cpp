@@ -1,33 +1,900 @@
 #include "jpeg.hpp"
 #include "chaotic_keystream_generator.hpp" // Replace .cpp with .hpp
+#include "coefficient_dump.hpp"
+#include "file_io.hpp"
+#include "jpeg_arena_memory.hpp"
+#include "restart_segments.hpp"
+#include "thread_pool.hpp"
 #include <algorithm>                       // Include this for std::remove
+#include <atomic>
+#include <chrono>
 #include <cstdint>                         // for uint64_t
+#include <cstring>
 #include <filesystem>
 #include <iomanip>
 #include <iostream>
+#include <jerror.h>
+#include <limits>
 #include <sstream>
 #include <stdio.h>
 #include <string>
 
+namespace {
+
+// Destination manager appending the compressed stream to a std::vector
+struct VectorDestination {
+  jpeg_destination_mgr pub;
+  std::vector<uint8_t> *out;
+};
+
+void vectorInitDestination(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  // Reuse whatever capacity the caller's buffer already has
+  dest->out->resize(std::max<size_t>(dest->out->capacity(), 64 * 1024));
+  dest->pub.next_output_byte = dest->out->data();
+  dest->pub.free_in_buffer = dest->out->size();
+}
+
+boolean vectorEmptyOutputBuffer(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  size_t used = dest->out->size();
+  dest->out->resize(used * 2);
+  dest->pub.next_output_byte = dest->out->data() + used;
+  dest->pub.free_in_buffer = dest->out->size() - used;
+  return TRUE;
+}
+
+void vectorTermDestination(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+  dest->out->resize(dest->out->size() - dest->pub.free_in_buffer);
+}
+
+// Source manager reading straight from a memory-mapped file. The whole
+// mapping is handed to the decoder as one buffer, so there are no read
+// calls and no intermediate copies.
+const JOCTET fakeEOI[2] = {0xFF, JPEG_EOI};
+
+void mappedInitSource(j_decompress_ptr) {}
+
+boolean mappedFillInputBuffer(j_decompress_ptr cinfo) {
+  // Asked for more data than the file holds: it is truncated (or the
+  // mapping was detached). Feed an EOI marker like libjpeg's own sources.
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  cinfo->src->next_input_byte = fakeEOI;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+void mappedSkipInputData(j_decompress_ptr cinfo, long numBytes) {
+  if (numBytes <= 0)
+    return;
+  while (numBytes > static_cast<long>(cinfo->src->bytes_in_buffer)) {
+    numBytes -= static_cast<long>(cinfo->src->bytes_in_buffer);
+    mappedFillInputBuffer(cinfo);
+  }
+  cinfo->src->next_input_byte += numBytes;
+  cinfo->src->bytes_in_buffer -= numBytes;
+}
+
+void mappedTermSource(j_decompress_ptr) {}
+
+void jpegMappedSrc(j_decompress_ptr cinfo, const MappedFile &file) {
+  // Allocated once in the permanent pool, like jpeg_stdio_src, so it
+  // outlives the mapping (see detachMappedSrc) and is reused with the context
+  if (cinfo->src == nullptr ||
+      cinfo->src->init_source != mappedInitSource) {
+    cinfo->src = static_cast<jpeg_source_mgr *>((*cinfo->mem->alloc_small)(
+        (j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(jpeg_source_mgr)));
+  }
+  auto *src = cinfo->src;
+  src->init_source = mappedInitSource;
+  src->fill_input_buffer = mappedFillInputBuffer;
+  src->skip_input_data = mappedSkipInputData;
+  src->resync_to_restart = jpeg_resync_to_restart;
+  src->term_source = mappedTermSource;
+  src->next_input_byte = file.data();
+  src->bytes_in_buffer = file.size();
+}
+
+void detachMappedSrc(j_decompress_ptr cinfo) {
+  // The coefficients are decoded; never touch the mapping again
+  cinfo->src->next_input_byte = fakeEOI;
+  cinfo->src->bytes_in_buffer = 0;
+}
+
+// Below this many blocks a single-threaded decode/encode is faster than
+// splitting the scan into restart bands
+const size_t restartSplitMinBlocks = 16384;
+
+std::atomic<size_t> defaultMemoryLimit{0};
+std::vector<Jpeg::Region> defaultRegions;
+
+// Start of the COM segments holding a tag (see Jpeg::setTag)
+const char tagPrefix[] = "JCRYPT ";
+const size_t tagPrefixLength = sizeof(tagPrefix) - 1;
+
+// Cipher working set per coefficient block besides the block itself: the
+// keystreams (DC and AC, some of them doubles), about 32 bytes on busy
+// photographs. The intra-block keys are a fixed table.
+const uint64_t cipherBytesPerBlock = 32;
+
+// Block swaps reach the coefficients at random, so each side of a swap
+// counts as a page faulted in against the memory limit, reported in runs
+// of swapsPerNote
+const int swapsPerNote = 64;
+const size_t faultBytes = 4096;
+
+// Blocks walked in order between two of those reports
+const size_t blocksPerNote = 256;
+
+// Decode a band of restart segments (see buildSegmentStream) on its own
+// context and copy its block rows into place, starting at MCU row firstMcuRow
+bool decodeBand(JpegContext &context, const std::vector<uint8_t> &stream,
+                JDIMENSION firstMcuRow,
+                std::vector<std::vector<JBLOCKROW>> &blockRows) {
+  jpeg_decompress_struct &cinfo = context.din;
+  if (setjmp(context.jerr.jump)) {
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+
+  cinfo.src = context.memSrc;
+  jpeg_mem_src(&cinfo, stream.data(),
+               static_cast<unsigned long>(stream.size()));
+  context.memSrc = cinfo.src;
+  if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK ||
+      cinfo.num_components != static_cast<int>(blockRows.size())) {
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+
+  jvirt_barray_ptr *bandCoeffs = jpeg_read_coefficients(&cinfo);
+  for (int comp = 0; comp < cinfo.num_components; comp++) {
+    auto *ci = cinfo.comp_info + comp;
+    JDIMENSION firstRow = cinfo.num_components == 1
+                              ? firstMcuRow
+                              : firstMcuRow * ci->v_samp_factor;
+    if (firstRow + ci->height_in_blocks > blockRows[comp].size()) {
+      jpeg_abort_decompress(&cinfo);
+      return false;
+    }
+    for (JDIMENSION r = 0; r < ci->height_in_blocks; ++r) {
+      JBLOCKARRAY row = (*cinfo.mem->access_virt_barray)(
+          (j_common_ptr)&cinfo, bandCoeffs[comp], r, 1, FALSE);
+      std::memcpy(blockRows[comp][firstRow + r], row[0],
+                  ci->width_in_blocks * sizeof(JBLOCK));
+    }
+  }
+  jpeg_abort_decompress(&cinfo);
+  return true;
+}
+
+// Natural-order index of each zigzag position (the order AC runs are coded)
+const int zigzagOrder[DCTSIZE2] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// Number of bits of |value| (the JPEG magnitude category)
+int magnitudeBits(int value) {
+  unsigned magnitude = value < 0 ? -value : value;
+  int bits = 0;
+  while (magnitude) {
+    ++bits;
+    magnitude >>= 1;
+  }
+  return bits;
+}
+
+// Whether a Huffman table has a code for every flagged symbol
+bool tableCodes(const JHUFF_TBL *table, const bool *used, int symbols) {
+  bool coded[256] = {};
+  if (table) {
+    int count = 0;
+    for (int length = 1; length <= 16; ++length)
+      count += table->bits[length];
+    for (int i = 0; i < count && i < 256; ++i)
+      coded[table->huffval[i]] = true;
+  }
+  for (int symbol = 0; symbol < symbols; ++symbol) {
+    if (used[symbol] && !coded[symbol])
+      return false;
+  }
+  return true;
+}
+
+// Encode with the Huffman tables (and table selection) of the source file
+void copyHuffmanTables(jpeg_decompress_struct &source,
+                       jpeg_compress_struct &cinfo) {
+  for (int t = 0; t < NUM_HUFF_TBLS; ++t) {
+    JHUFF_TBL **from[2] = {source.dc_huff_tbl_ptrs, source.ac_huff_tbl_ptrs};
+    JHUFF_TBL **to[2] = {cinfo.dc_huff_tbl_ptrs, cinfo.ac_huff_tbl_ptrs};
+    for (int kind = 0; kind < 2; ++kind) {
+      if (!from[kind][t])
+        continue;
+      if (!to[kind][t])
+        to[kind][t] = jpeg_alloc_huff_table((j_common_ptr)&cinfo);
+      std::memcpy(to[kind][t]->bits, from[kind][t]->bits,
+                  sizeof(to[kind][t]->bits));
+      std::memcpy(to[kind][t]->huffval, from[kind][t]->huffval,
+                  sizeof(to[kind][t]->huffval));
+      to[kind][t]->sent_table = FALSE;
+    }
+  }
+  for (int comp = 0; comp < source.num_components; comp++) {
+    cinfo.comp_info[comp].dc_tbl_no = source.comp_info[comp].dc_tbl_no;
+    cinfo.comp_info[comp].ac_tbl_no = source.comp_info[comp].ac_tbl_no;
+  }
+}
+
+// Entropy code block rows starting at MCU row firstMcuRow as a standalone
+// JPEG `height` pixels tall, on its own context, with the critical
+// parameters of `source` and standard (or its original) Huffman tables
+bool encodeBand(JpegContext &context, jpeg_decompress_struct &source,
+                const std::vector<std::vector<JBLOCKROW>> &blockRows,
+                JDIMENSION firstMcuRow, unsigned height, unsigned interval,
+                bool originalTables, std::vector<uint8_t> &out) {
+  jpeg_compress_struct &cinfo = context.dout;
+  if (setjmp(context.jerr.jump)) {
+    jpeg_abort_compress(&cinfo);
+    cinfo.dest = nullptr;
+    return false;
+  }
+
+  jpeg_copy_critical_parameters(&source, &cinfo);
+  cinfo.image_height = height;
+  cinfo.restart_interval = interval;
+  if (originalTables)
+    copyHuffmanTables(source, cinfo);
+
+  auto *bandCoeffs = static_cast<jvirt_barray_ptr *>((*cinfo.mem->alloc_small)(
+      (j_common_ptr)&cinfo, JPOOL_IMAGE,
+      sizeof(jvirt_barray_ptr) * source.num_components));
+  std::vector<JDIMENSION> bandRows(source.num_components);
+  for (int comp = 0; comp < source.num_components; comp++) {
+    auto *ci = source.comp_info + comp;
+    JDIMENSION h = ci->h_samp_factor, v = ci->v_samp_factor;
+    JDIMENSION unit = source.max_v_samp_factor * DCTSIZE;
+    bandRows[comp] = (JDIMENSION(height) * v + unit - 1) / unit;
+    bandCoeffs[comp] = (*cinfo.mem->request_virt_barray)(
+        (j_common_ptr)&cinfo, JPOOL_IMAGE, TRUE,
+        (ci->width_in_blocks + h - 1) / h * h,
+        (bandRows[comp] + v - 1) / v * v, v);
+  }
+  (*cinfo.mem->realize_virt_arrays)((j_common_ptr)&cinfo);
+
+  for (int comp = 0; comp < source.num_components; comp++) {
+    auto *ci = source.comp_info + comp;
+    JDIMENSION firstRow = source.num_components == 1
+                              ? firstMcuRow
+                              : firstMcuRow * ci->v_samp_factor;
+    for (JDIMENSION r = 0; r < bandRows[comp]; ++r) {
+      JBLOCKARRAY row = (*cinfo.mem->access_virt_barray)(
+          (j_common_ptr)&cinfo, bandCoeffs[comp], r, 1, TRUE);
+      std::memcpy(row[0], blockRows[comp][firstRow + r],
+                  ci->width_in_blocks * sizeof(JBLOCK));
+    }
+  }
+
+  VectorDestination dest{};
+  dest.pub.init_destination = vectorInitDestination;
+  dest.pub.empty_output_buffer = vectorEmptyOutputBuffer;
+  dest.pub.term_destination = vectorTermDestination;
+  dest.out = &out;
+  cinfo.dest = &dest.pub;
+  jpeg_write_coefficients(&cinfo, bandCoeffs);
+  jpeg_finish_compress(&cinfo);
+  cinfo.dest = nullptr; // dest lives on this stack frame
+  return true;
+}
+
+// Dump planes are used as JBLOCK rows in place
+static_assert(sizeof(JCOEF) == sizeof(int16_t), "JCOEF must be 16 bits");
+
+// Append a marker segment and its length field
+void appendSegment(std::vector<uint8_t> &out, uint8_t marker,
+                   const std::vector<uint8_t> &payload) {
+  size_t length = payload.size() + 2;
+  out.insert(out.end(), {0xFF, marker, static_cast<uint8_t>(length >> 8),
+                         static_cast<uint8_t>(length)});
+  out.insert(out.end(), payload.begin(), payload.end());
+}
+
+// JPEG headers describing a dump's image: tables, frame and a first SOS,
+// which jpeg_read_header needs to finish. No scan data follows.
+std::vector<uint8_t> dumpHeaderStream(const CoefficientDumpHeader &header) {
+  std::vector<uint8_t> out = {0xFF, 0xD8};
+  for (int t = 0; t < 4; ++t) {
+    if (!header.quantPresent[t])
+      continue;
+    const uint16_t *table = header.quantTables[t];
+    const bool wide = std::any_of(table, table + DCTSIZE2,
+                                  [](uint16_t value) { return value > 255; });
+    std::vector<uint8_t> payload = {
+        static_cast<uint8_t>((wide ? 0x10 : 0) | t)};
+    for (int k = 0; k < DCTSIZE2; ++k) { // DQT lists zigzag order
+      uint16_t value = table[zigzagOrder[k]];
+      if (wide)
+        payload.push_back(static_cast<uint8_t>(value >> 8));
+      payload.push_back(static_cast<uint8_t>(value));
+    }
+    appendSegment(out, 0xDB, payload);
+  }
+  for (int tableClass = 0; tableClass < 2; ++tableClass) {
+    const auto &tables = tableClass == 0 ? header.dcTables : header.acTables;
+    for (int t = 0; t < 4; ++t) {
+      if (!tables[t].present)
+        continue;
+      std::vector<uint8_t> payload = {
+          static_cast<uint8_t>(tableClass << 4 | t)};
+      payload.insert(payload.end(), tables[t].counts, tables[t].counts + 16);
+      payload.insert(payload.end(), tables[t].symbols.begin(),
+                     tables[t].symbols.end());
+      appendSegment(out, 0xC4, payload);
+    }
+  }
+
+  std::vector<uint8_t> frame = {
+      8,
+      static_cast<uint8_t>(header.height >> 8),
+      static_cast<uint8_t>(header.height),
+      static_cast<uint8_t>(header.width >> 8),
+      static_cast<uint8_t>(header.width),
+      static_cast<uint8_t>(header.components.size())};
+  std::vector<uint8_t> scan = {
+      static_cast<uint8_t>(header.components.size())};
+  for (const auto &comp : header.components) {
+    frame.insert(frame.end(),
+                 {static_cast<uint8_t>(comp.id),
+                  static_cast<uint8_t>(comp.hSampling << 4 | comp.vSampling),
+                  static_cast<uint8_t>(comp.quantTable)});
+    scan.insert(scan.end(), {static_cast<uint8_t>(comp.id), 0});
+  }
+  appendSegment(out, header.progressive ? 0xC2 : 0xC0, frame);
+  scan.insert(scan.end(), {0, static_cast<uint8_t>(header.progressive ? 0 : 63),
+                           0});
+  appendSegment(out, 0xDA, scan);
+  out.insert(out.end(), {0xFF, 0xD9});
+  return out;
+}
+
+} // namespace
+
+Jpeg::Jpeg()
+    : context(JpegContextPool::global().acquire()), din(context->din),
+      dout(context->dout), jerr(context->jerr), regions(defaultRegions),
+      memoryLimit(defaultMemoryLimit) {}
+
+Jpeg::~Jpeg() = default;
+
+bool Jpeg::probe(const std::wstring &path, ImageInfo &info) {
+  info = ImageInfo();
+
+  // A dump's blocks are mapped rather than decoded, but still take memory
+  // once the cipher touches them
+  MappedFile mapped;
+  CoefficientDumpHeader header;
+  std::string error;
+  if (mapped.open(path) && isCoefficientDump(mapped.data(), mapped.size())) {
+    if (!parseCoefficientDump(mapped.data(), mapped.size(), header, error))
+      return false;
+    info.width = static_cast<int>(header.width);
+    info.height = static_cast<int>(header.height);
+    info.progressive = header.progressive;
+    for (const auto &comp : header.components) {
+      ImageInfo::Component component;
+      component.widthInBlocks = static_cast<int>(comp.widthInBlocks);
+      component.heightInBlocks = static_cast<int>(comp.heightInBlocks);
+      component.hSampling = comp.hSampling;
+      component.vSampling = comp.vSampling;
+      info.components.push_back(component);
+      info.blocks += uint64_t(comp.widthInBlocks) * comp.heightInBlocks;
+    }
+    info.estimatedCost = info.blocks;
+    info.peakBytes = info.blocks * (sizeof(JBLOCK) + cipherBytesPerBlock);
+    return true;
+  }
+  mapped.close();
+
+  FILE *f = openFile(path, L"rb");
+  if (!f)
+    return false;
+
+  // The lease resets the context on return, which also aborts the read
+  auto context = JpegContextPool::global().acquire();
+  jpeg_decompress_struct &cinfo = context->din;
+  if (setjmp(context->jerr.jump)) {
+    fclose(f);
+    return false;
+  }
+  cinfo.src = context->stdioSrc;
+  jpeg_stdio_src(&cinfo, f);
+  context->stdioSrc = cinfo.src;
+  if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+    fclose(f);
+    return false;
+  }
+
+  // The first SOS has been read, so the block grid is already known
+  info.width = cinfo.image_width;
+  info.height = cinfo.image_height;
+  info.progressive = cinfo.progressive_mode;
+  info.restartInterval = cinfo.restart_interval;
+  for (int comp = 0; comp < cinfo.num_components; comp++) {
+    auto *ci = cinfo.comp_info + comp;
+    ImageInfo::Component component;
+    component.widthInBlocks = ci->width_in_blocks;
+    component.heightInBlocks = ci->height_in_blocks;
+    component.hSampling = ci->h_samp_factor;
+    component.vSampling = ci->v_samp_factor;
+    info.components.push_back(component);
+    info.blocks += uint64_t(ci->width_in_blocks) * ci->height_in_blocks;
+  }
+  info.estimatedCost = info.progressive ? info.blocks * 2 : info.blocks;
+
+  uint64_t coefficientBytes = info.blocks * sizeof(JBLOCK);
+  const size_t limit = defaultMemoryLimit;
+  if (limit && coefficientBytes > limit)
+    info.peakBytes = limit; // the rest is paged to the backing file
+  else if (info.restartInterval && info.blocks >= restartSplitMinBlocks)
+    info.peakBytes = coefficientBytes * 2;
+  else
+    info.peakBytes = coefficientBytes;
+  info.peakBytes += info.blocks * cipherBytesPerBlock;
+  fclose(f);
+  return true;
+}
+
 bool Jpeg::load(const std::wstring &path) {
-  jpeg_create_decompress(&din);
-  din.err = jpeg_std_error(&jerr);
-  FILE *f = _wfopen(path.c_str(), L"rb");
+  // Decode straight from a mapping of the file when possible. With a memory
+  // limit, a JPEG is read through stdio instead: a mapping would keep the
+  // whole file resident next to the limited coefficients.
+  MappedFile mapped;
+  if (mapped.open(path)) {
+    if (isCoefficientDump(mapped.data(), mapped.size())) {
+      mapped.close();
+      auto file = std::make_unique<MappedFile>();
+      if (!file->open(path, true))
+        return false;
+      beginDecompress();
+      inputBytes = file->size();
+      return loadDump(std::move(file));
+    }
+    if (!memoryLimit) {
+      beginDecompress();
+      din.src = context->mappedSrc;
+      jpegMappedSrc(&din, mapped);
+      context->mappedSrc = din.src;
+      bool ok = readCoefficients(mapped.data(), mapped.size());
+      if (ok)
+        detachMappedSrc(&din);
+      inputBytes = mapped.size();
+      return ok;
+    }
+    mapped.close();
+  }
+
+  // Pipes, empty and special files go through stdio, and so do JPEGs under
+  // a memory limit
+  FILE *f = openFile(path, L"rb");
   if (!f)
     return false;
+  beginDecompress();
+  din.src = context->stdioSrc;
   jpeg_stdio_src(&din, f);
+  context->stdioSrc = din.src;
+  bool ok = readCoefficients();
+  fclose(f);
+  std::error_code ec;
+  inputBytes = static_cast<size_t>(std::filesystem::file_size(path, ec));
+  if (ec)
+    inputBytes = 0; // a pipe or device: size unknown
+  return ok;
+}
+
+bool Jpeg::loadFromMemory(const uint8_t *data, size_t size) {
+  if (!data || size == 0)
+    return false;
+  beginDecompress();
+  din.src = context->memSrc;
+  jpeg_mem_src(&din, data, static_cast<unsigned long>(size));
+  context->memSrc = din.src;
+  inputBytes = size;
+  return readCoefficients(data, size);
+}
+
+void Jpeg::beginDecompress() {
+  jpeg_abort_decompress(&din);
+  context->restoreStandardTables();
+  // The context is shared, so the limit is set for every image
+  din.mem->max_memory_to_use = static_cast<long>(
+      std::min<size_t>(memoryLimit, std::numeric_limits<long>::max()));
+  coeffs = nullptr;
+  coefficientsBacked = false;
+  blockRows.clear();
+  dumpFile.reset();
+  scanList.clear();
+  tag.clear();
+  jpeg_save_markers(&din, JPEG_COM, 0xFFFF); // for the tag
+  scanMonitor.timing = false;
+  sourceScriptUsable = false;
+}
+
+bool Jpeg::readCoefficients(const uint8_t *data, size_t size) {
+  if (setjmp(jerr.jump)) {
+    din.progress = nullptr;
+    jpeg_abort_decompress(&din);
+    return false;
+  }
+
+  // Time every scan (see onScanProgress); the hook is detached on return,
+  // since the context outlives this object
+  scanMonitor.pub.progress_monitor = onScanProgress;
+  scanMonitor.owner = this;
+  din.progress = &scanMonitor.pub;
+
   if (jpeg_read_header(&din, TRUE) != JPEG_HEADER_OK) {
-    fclose(f);
+    din.progress = nullptr;
+    jpeg_abort_decompress(&din);
     return false;
   }
-  coeffs = jpeg_read_coefficients(&din);
+  recordScan();
+  for (auto *marker = din.marker_list; marker; marker = marker->next) {
+    if (marker->marker == JPEG_COM && marker->data_length >= tagPrefixLength &&
+        std::memcmp(marker->data, tagPrefix, tagPrefixLength) == 0)
+      tag.assign(reinterpret_cast<const char *>(marker->data) +
+                     tagPrefixLength,
+                 marker->data_length - tagPrefixLength);
+  }
+
+  // Large files with restart markers decode band by band in parallel
+  ScanLayout layout;
+  std::vector<RestartBand> bands;
+  if (data && planRestartBands(data, size, layout, bands)) {
+    if (!decodeRestartBands(data, layout, bands)) {
+      din.progress = nullptr;
+      jpeg_abort_decompress(&din);
+      return false;
+    }
+  } else {
+    coeffs = jpeg_read_coefficients(&din);
+    cacheBlockRows();
+  }
+  finishScan();
+  din.progress = nullptr;
+
+  // The decoder accepts some malformed progressions with a warning that
+  // the encoder would reject, so only a clean script is reused on save
+  sourceScriptUsable = din.progressive_mode && din.err->num_warnings == 0;
   width = din.image_width;
   height = din.image_height;
   comps = din.num_components;
-  fclose(f);
+  selectBlocks();
   return true;
 }
 
+void Jpeg::onScanProgress(j_common_ptr cinfo) {
+  // Called per block row and at every SOS; only a new scan matters
+  auto *monitor = reinterpret_cast<ScanMonitor *>(cinfo->progress);
+  Jpeg *self = monitor->owner;
+  if (self->din.input_scan_number != static_cast<int>(self->scanList.size()))
+    self->recordScan();
+}
+
+void Jpeg::recordScan() {
+  finishScan();
+  ScanInfo scan;
+  for (int i = 0; i < din.comps_in_scan; ++i)
+    scan.components.push_back(din.cur_comp_info[i]->component_index);
+  scan.ss = din.Ss;
+  scan.se = din.Se;
+  scan.ah = din.Ah;
+  scan.al = din.Al;
+  scanList.push_back(scan);
+  scanMonitor.scanStart = std::chrono::steady_clock::now();
+  scanMonitor.timing = true;
+}
+
+void Jpeg::finishScan() {
+  if (!scanMonitor.timing)
+    return;
+  scanMonitor.timing = false;
+  scanList.back().decodeMs =
+      std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - scanMonitor.scanStart)
+          .count();
+}
+
+const std::vector<Jpeg::ScanInfo> &Jpeg::scans() const { return scanList; }
+
+bool Jpeg::isProgressive() const { return din.progressive_mode; }
+
+bool Jpeg::planRestartBands(const uint8_t *data, size_t size,
+                            ScanLayout &layout,
+                            std::vector<RestartBand> &bands) {
+  if (din.progressive_mode || din.restart_interval == 0 ||
+      !splitIntoBands(din.restart_interval, bands))
+    return false;
+
+  // Every segment the MCU grid implies must be present in the file
+  return indexRestartSegments(data, size, layout) &&
+         layout.restartInterval == din.restart_interval &&
+         layout.segments.size() == bands.back().lastSegment;
+}
+
+bool Jpeg::splitIntoBands(unsigned interval,
+                          std::vector<RestartBand> &bands) const {
+  ThreadPool &pool = ThreadPool::global();
+  if (pool.size() < 2 || interval == 0)
+    return false;
+
+  size_t totalBlocks = 0;
+  for (int comp = 0; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    totalBlocks += size_t(ci->width_in_blocks) * ci->height_in_blocks;
+  }
+  if (totalBlocks < restartSplitMinBlocks)
+    return false;
+
+  // Bands are decoded and encoded through copies of their rows, which a
+  // memory-limited image has no room for
+  if (memoryLimit && totalBlocks * sizeof(JBLOCK) > memoryLimit)
+    return false;
+
+  // MCU grid of the scan; a single-component scan has one block per MCU
+  size_t mcusPerRow, mcuRows;
+  unsigned mcuHeight;
+  if (din.num_components == 1) {
+    mcusPerRow = din.comp_info[0].width_in_blocks;
+    mcuRows = din.comp_info[0].height_in_blocks;
+    mcuHeight = DCTSIZE;
+  } else {
+    mcuHeight = din.max_v_samp_factor * DCTSIZE;
+    size_t mcuWidth = din.max_h_samp_factor * DCTSIZE;
+    mcusPerRow = (din.image_width + mcuWidth - 1) / mcuWidth;
+    mcuRows = (din.image_height + mcuHeight - 1) / mcuHeight;
+  }
+
+  // Bands must start on both an MCU row and a restart boundary
+  size_t a = interval, b = mcusPerRow;
+  while (b != 0) {
+    size_t t = a % b;
+    a = b;
+    b = t;
+  }
+  const size_t rowUnit = interval / a;
+  const size_t targetBands = pool.size() * 2;
+  size_t rowsPerBand = (mcuRows + targetBands - 1) / targetBands;
+  rowsPerBand = (rowsPerBand + rowUnit - 1) / rowUnit * rowUnit;
+  if (rowsPerBand >= mcuRows)
+    return false;
+
+  bands.clear();
+  for (size_t row = 0; row < mcuRows; row += rowsPerBand) {
+    size_t endRow = std::min(row + rowsPerBand, mcuRows);
+    RestartBand band;
+    band.firstSegment = row * mcusPerRow / interval;
+    band.lastSegment = (endRow * mcusPerRow + interval - 1) / interval;
+    band.firstMcuRow = static_cast<JDIMENSION>(row);
+    band.height = endRow == mcuRows
+                      ? din.image_height - unsigned(row) * mcuHeight
+                      : unsigned(endRow - row) * mcuHeight;
+    bands.push_back(band);
+  }
+  return true;
+}
+
+bool Jpeg::decodeRestartBands(const uint8_t *data, const ScanLayout &layout,
+                              const std::vector<RestartBand> &bands) {
+  allocateCoefficients();
+  cacheBlockRows();
+
+  std::atomic<bool> ok{true};
+  ThreadPool::global().parallelFor(
+      0, static_cast<int>(bands.size()), 1, [&](int first, int last) {
+        std::vector<uint8_t> stream;
+        for (int i = first; i < last && ok; ++i) {
+          const RestartBand &band = bands[i];
+          buildSegmentStream(data, layout, band.firstSegment,
+                             band.lastSegment, band.height, stream);
+          auto bandContext = JpegContextPool::global().acquire();
+          if (!decodeBand(*bandContext, stream, band.firstMcuRow,
+                          blockRows))
+            ok = false;
+        }
+      });
+  return ok;
+}
+
+void Jpeg::allocateCoefficients() {
+  // Same array shape jpeg_read_coefficients would request, so the
+  // coefficients look identical to the rest of the class and to the encoder
+  coeffs = static_cast<jvirt_barray_ptr *>((*din.mem->alloc_small)(
+      (j_common_ptr)&din, JPOOL_IMAGE,
+      sizeof(jvirt_barray_ptr) * din.num_components));
+  for (int comp = 0; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    JDIMENSION h = ci->h_samp_factor, v = ci->v_samp_factor;
+    coeffs[comp] = (*din.mem->request_virt_barray)(
+        (j_common_ptr)&din, JPOOL_IMAGE, TRUE,
+        (ci->width_in_blocks + h - 1) / h * h,
+        (ci->height_in_blocks + v - 1) / v * v, v);
+  }
+  (*din.mem->realize_virt_arrays)((j_common_ptr)&din);
+}
+
+bool Jpeg::loadDump(std::unique_ptr<MappedFile> file) {
+  CoefficientDumpHeader header;
+  std::string error;
+  if (!parseCoefficientDump(file->data(), file->size(), header, error))
+    return false;
+  std::vector<uint8_t> stream = dumpHeaderStream(header);
+
+  if (setjmp(jerr.jump)) {
+    jpeg_abort_decompress(&din);
+    return false;
+  }
+  din.src = context->memSrc;
+  jpeg_mem_src(&din, stream.data(), static_cast<unsigned long>(stream.size()));
+  context->memSrc = din.src;
+  if (jpeg_read_header(&din, TRUE) != JPEG_HEADER_OK) {
+    jpeg_abort_decompress(&din);
+    return false;
+  }
+  detachMappedSrc(&din); // the headers are read; stream goes away
+
+  // The block grid libjpeg derives from the frame must be the dump's
+  for (int comp = 0; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    if (ci->width_in_blocks != header.components[comp].widthInBlocks ||
+        ci->height_in_blocks != header.components[comp].heightInBlocks) {
+      jpeg_abort_decompress(&din);
+      return false;
+    }
+  }
+
+  // The planes are the block rows: the cipher stages work on the mapping
+  // directly, and the kernel copies only the pages they change. Coefficient
+  // arrays are allocated once a JPEG is encoded from them.
+  blockRows.assign(din.num_components, {});
+  for (int comp = 0; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    auto plane = reinterpret_cast<JBLOCKROW>(
+        file->writableData() + header.components[comp].planeOffset);
+    for (JDIMENSION r = 0; r < ci->height_in_blocks; ++r)
+      blockRows[comp].push_back(plane + size_t(r) * ci->width_in_blocks);
+  }
+  dumpFile = std::move(file);
+  tag = header.tag;
+  width = din.image_width;
+  height = din.image_height;
+  comps = din.num_components;
+  selectBlocks();
+  return true;
+}
+
+void Jpeg::copyDumpToArrays() {
+  if (!coeffs)
+    allocateCoefficients();
+  for (int comp = 0; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    for (JDIMENSION r = 0; r < ci->height_in_blocks; ++r) {
+      JBLOCKARRAY row = din.mem->access_virt_barray((j_common_ptr)&din,
+                                                    coeffs[comp], r, 1, TRUE);
+      std::memcpy(row[0], blockRows[comp][r],
+                  ci->width_in_blocks * sizeof(JBLOCK));
+    }
+  }
+}
+
+bool Jpeg::isDump() const { return dumpFile != nullptr; }
+
+bool Jpeg::saveDump(const std::wstring &path) {
+  if (blockRows.empty())
+    return false;
+  auto start = std::chrono::steady_clock::now();
+
+  CoefficientDumpHeader header;
+  header.width = din.image_width;
+  header.height = din.image_height;
+  header.progressive = din.progressive_mode;
+  for (int comp = 0; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    CoefficientDumpHeader::Component component;
+    component.id = ci->component_id;
+    component.hSampling = ci->h_samp_factor;
+    component.vSampling = ci->v_samp_factor;
+    component.quantTable = ci->quant_tbl_no;
+    component.widthInBlocks = ci->width_in_blocks;
+    component.heightInBlocks = ci->height_in_blocks;
+    header.components.push_back(component);
+  }
+  for (int t = 0; t < 4; ++t) {
+    if (const JQUANT_TBL *table = din.quant_tbl_ptrs[t]) {
+      header.quantPresent[t] = true;
+      std::copy(table->quantval, table->quantval + DCTSIZE2,
+                header.quantTables[t]);
+    }
+    const JHUFF_TBL *huffman[2] = {din.dc_huff_tbl_ptrs[t],
+                                   din.ac_huff_tbl_ptrs[t]};
+    CoefficientDumpHeader::HuffmanTable *tables[2] = {&header.dcTables[t],
+                                                      &header.acTables[t]};
+    for (int c = 0; c < 2; ++c) {
+      if (!huffman[c])
+        continue;
+      int count = 0;
+      for (int length = 1; length <= 16; ++length) {
+        tables[c]->counts[length - 1] = huffman[c]->bits[length];
+        count += huffman[c]->bits[length];
+      }
+      tables[c]->symbols.assign(huffman[c]->huffval,
+                                huffman[c]->huffval + std::min(count, 256));
+      tables[c]->present = true;
+    }
+  }
+  header.tag = tag;
+  const std::vector<uint8_t> head = formatCoefficientDump(header);
+
+  // Written aside and renamed over the target, which may be the mapped
+  // dump this image came from: truncating that would pull its pages away
+  std::filesystem::path target(path), part(path);
+  part += L".part";
+  FILE *f = openFile(part.wstring(), L"wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(head.data(), 1, head.size(), f) == head.size();
+  uint64_t written = head.size();
+  const char padding[dumpPlaneAlignment] = {};
+  for (int comp = 0; comp < din.num_components && ok; comp++) {
+    auto *ci = din.comp_info + comp;
+    size_t gap = static_cast<size_t>(header.components[comp].planeOffset -
+                                     written);
+    ok = fwrite(padding, 1, gap, f) == gap;
+    for (JDIMENSION r = 0; r < ci->height_in_blocks && ok; ++r) {
+      ok = fwrite(blockRows[comp][r], sizeof(JBLOCK), ci->width_in_blocks,
+                  f) == ci->width_in_blocks;
+      noteCoefficientAccess(ci->width_in_blocks * sizeof(JBLOCK));
+    }
+    written = header.components[comp].planeOffset +
+              uint64_t(ci->width_in_blocks) * ci->height_in_blocks *
+                  sizeof(JBLOCK);
+  }
+  ok = fclose(f) == 0 && ok;
+  std::error_code ec;
+  if (ok)
+    std::filesystem::rename(part, target, ec);
+  if (!ok || ec) {
+    std::filesystem::remove(part, ec);
+    return false;
+  }
+  recordSave(huffmanMode, static_cast<size_t>(written), start);
+  return true;
+}
+
+void Jpeg::cacheBlockRows() {
+  // jpeg_read_coefficients keeps the whole coefficient set in memory (or
+  // in a mapping of its backing file), so every block row stays at a fixed
+  // address. Resolving the rows once here lets the cipher stages run
+  // concurrently without calling back into the (non thread-safe) libjpeg
+  // memory manager.
+  blockRows.assign(din.num_components, {});
+  coefficientsBacked = din.num_components > 0 && isVirtArrayBacked(coeffs[0]);
+  for (int comp = 0; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    for (JDIMENSION r = 0; r < ci->height_in_blocks; ++r) {
+      JBLOCKARRAY row = din.mem->access_virt_barray((j_common_ptr)&din,
+                                                    coeffs[comp], r, 1, TRUE);
+      blockRows[comp].push_back(row[0]);
+    }
+  }
+}
+
+void Jpeg::noteCoefficientAccess(size_t bytes) const {
+  if (coefficientsBacked)
+    noteVirtArrayAccess(coeffs[0], bytes);
+}
+
 std::vector<int>
 Jpeg::generateDCPermutationKeystream(int lenDC,
                                      const ChaoticSystems::MasterKey &key) {
@@ -40,6 +907,7 @@ Jpeg::generateDCPermutationKeystream(int lenDC,
   //auto jiaKeystream = key.generateJiaKeystream(lenDC - 1);
   auto jiaKeystream = key.generateArnoldKeystream(lenDC - 1);
   std::vector<int> permutationKeystream;
+  permutationKeystream.reserve(lenDC - 2);
 
   for (int m = 0; m < lenDC - 2; ++m) {
     double sm = std::fabs(jiaKeystream[m]);
@@ -51,6 +919,113 @@ Jpeg::generateDCPermutationKeystream(int lenDC,
   return permutationKeystream;
 }
 
+void Jpeg::setRegions(const std::vector<Region> &list) {
+  regions = list;
+  if (!blockRows.empty())
+    selectBlocks();
+}
+
+const std::vector<Jpeg::Region> &Jpeg::getRegions() const { return regions; }
+
+void Jpeg::setDefaultRegions(const std::vector<Region> &list) {
+  defaultRegions = list;
+}
+
+void Jpeg::selectBlocks() {
+  spans.assign(din.num_components, {});
+  selectedBlocks.assign(din.num_components, 0);
+  for (int comp = 0; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    auto &list = spans[comp];
+    if (regions.empty()) {
+      for (JDIMENSION r = 0; r < ci->height_in_blocks; ++r)
+        list.push_back({r, 0, ci->width_in_blocks,
+                        size_t(r) * ci->width_in_blocks});
+      selectedBlocks[comp] =
+          size_t(ci->width_in_blocks) * ci->height_in_blocks;
+      continue;
+    }
+
+    // Pixel edges scale by the component's share of the largest sampling
+    // factors; a block touched by a rectangle is selected as a whole
+    const long hScale = long(din.max_h_samp_factor) * DCTSIZE;
+    const long vScale = long(din.max_v_samp_factor) * DCTSIZE;
+    std::vector<std::vector<std::pair<JDIMENSION, JDIMENSION>>> rows(
+        ci->height_in_blocks);
+    for (const Region &region : regions) {
+      long x0 = std::max(0, region.x), y0 = std::max(0, region.y);
+      long x1 = std::min<long>(width, long(region.x) + region.width);
+      long y1 = std::min<long>(height, long(region.y) + region.height);
+      if (x0 >= x1 || y0 >= y1)
+        continue;
+      JDIMENSION c0 = x0 * ci->h_samp_factor / hScale;
+      JDIMENSION c1 = std::min<long>(
+          ci->width_in_blocks,
+          (x1 * ci->h_samp_factor + hScale - 1) / hScale);
+      JDIMENSION r0 = y0 * ci->v_samp_factor / vScale;
+      JDIMENSION r1 = std::min<long>(
+          ci->height_in_blocks,
+          (y1 * ci->v_samp_factor + vScale - 1) / vScale);
+      for (JDIMENSION r = r0; r < r1; ++r)
+        rows[r].push_back({c0, c1});
+    }
+
+    // Overlapping rectangles merge into disjoint spans, left to right
+    size_t index = 0;
+    for (JDIMENSION r = 0; r < rows.size(); ++r) {
+      auto &runs = rows[r];
+      std::sort(runs.begin(), runs.end());
+      for (size_t i = 0; i < runs.size();) {
+        JDIMENSION begin = runs[i].first, end = runs[i].second;
+        for (++i; i < runs.size() && runs[i].first <= end; ++i)
+          end = std::max(end, runs[i].second);
+        list.push_back({r, begin, end, index});
+        index += end - begin;
+      }
+    }
+    selectedBlocks[comp] = index;
+  }
+}
+
+JCOEFPTR Jpeg::laneBlock(bool isLuminance, size_t index) const {
+  for (int comp = isLuminance ? 0 : 1; comp < din.num_components; comp++) {
+    auto *ci = din.comp_info + comp;
+    if (index < selectedBlocks[comp]) {
+      // A fully selected component needs no span lookup
+      if (selectedBlocks[comp] ==
+          size_t(ci->width_in_blocks) * ci->height_in_blocks)
+        return blockRows[comp][index / ci->width_in_blocks]
+                        [index % ci->width_in_blocks];
+      const auto &list = spans[comp];
+      auto span = std::upper_bound(list.begin(), list.end(), index,
+                                   [](size_t i, const BlockSpan &s) {
+                                     return i < s.firstIndex;
+                                   }) -
+                  1;
+      return blockRows[comp][span->row]
+                      [span->colBegin + (index - span->firstIndex)];
+    }
+    index -= selectedBlocks[comp];
+    if (isLuminance)
+      break;
+  }
+  return nullptr;
+}
+
+template <typename Visit>
+void Jpeg::forEachLaneBlock(bool isLuminance, Visit &&visit) const {
+  for (int comp = isLuminance ? 0 : 1; comp < din.num_components; comp++) {
+    for (const BlockSpan &span : spans[comp]) {
+      JBLOCKROW row = blockRows[comp][span.row];
+      for (JDIMENSION c = span.colBegin; c < span.colEnd; ++c)
+        visit(row[c]);
+      noteCoefficientAccess((span.colEnd - span.colBegin) * sizeof(JBLOCK));
+    }
+    if (isLuminance)
+      break;
+  }
+}
+
 uint64_t Jpeg::extractSignificantDigits(double value, int digits) {
   if (value <= 0.0 || digits <= 0 || digits > 17)
     return 0;
@@ -95,145 +1070,427 @@ void Jpeg::processDCReverse(bool isLuminance, const std::vector<int> &key) {
   applyDC(dcCoefficients, isLuminance);
 }
 
+void Jpeg::setRestartInterval(unsigned mcus) {
+  restartInterval = std::min(mcus, 65535u); // DRI holds 16 bits
+}
+
+void Jpeg::setHuffmanMode(HuffmanMode mode) { huffmanMode = mode; }
+
+void Jpeg::setMemoryLimit(size_t bytes) { memoryLimit = bytes; }
+
+void Jpeg::setDefaultMemoryLimit(size_t bytes) { defaultMemoryLimit = bytes; }
+
+void Jpeg::setScanMode(ScanMode mode) { scanMode = mode; }
+
+void Jpeg::setTag(const std::string &text) { tag = text; }
+
+const std::string &Jpeg::getTag() const { return tag; }
+
+bool Jpeg::progressiveOutput() const {
+  return scanMode == ScanMode::Progressive ||
+         (scanMode == ScanMode::Source && din.progressive_mode);
+}
+
+const Jpeg::SaveStats &Jpeg::lastSaveStats() const { return saveStats; }
+
+const char *Jpeg::huffmanModeName(HuffmanMode mode) {
+  switch (mode) {
+  case HuffmanMode::Original:
+    return "original";
+  case HuffmanMode::Optimized:
+    return "optimized";
+  default:
+    return "standard";
+  }
+}
+
 bool Jpeg::save(const std::wstring &path, int quality) {
-  jpeg_create_compress(&dout);
-  dout.err = jpeg_std_error(&jerr);
-  FILE *f = _wfopen(path.c_str(), L"wb");
+  auto start = std::chrono::steady_clock::now();
+  HuffmanMode mode = resolveHuffmanMode();
+
+  // Band-parallel encodes are assembled in memory and written in one go.
+  // Optimized tables (and so progressive output) are per-scan, so those
+  // always encode serially.
+  std::vector<RestartBand> bands;
+  if (mode != HuffmanMode::Optimized &&
+      splitIntoBands(restartInterval, bands)) {
+    std::vector<uint8_t> encoded;
+    if (!encodeRestartBands(bands, mode, encoded))
+      return false;
+    FILE *f = openFile(path, L"wb");
+    if (!f)
+      return false;
+    bool ok = fwrite(encoded.data(), 1, encoded.size(), f) == encoded.size();
+    ok = fclose(f) == 0 && ok;
+    if (ok)
+      recordSave(mode, encoded.size(), start);
+    return ok;
+  }
+
+  FILE *f = openFile(path, L"wb");
   if (!f)
     return false;
+  beginCompress();
+  dout.dest = context->stdioDest;
   jpeg_stdio_dest(&dout, f);
-  jpeg_copy_critical_parameters(&din, &dout);
-  jpeg_write_coefficients(&dout, coeffs);
-  jpeg_finish_compress(&dout);
-  jpeg_destroy_compress(&dout);
-  jpeg_finish_decompress(&din);
-  jpeg_destroy_decompress(&din);
+  context->stdioDest = dout.dest;
+  bool ok = writeCoefficients(mode);
+  long written = ftell(f);
   fclose(f);
-  return true;
+  if (ok)
+    recordSave(mode, written > 0 ? size_t(written) : 0, start);
+  return ok;
 }
 
-int Jpeg::getWidth() const { return width; }
-int Jpeg::getHeight() const { return height; }
-int Jpeg::getComponents() const { return comps; }
+bool Jpeg::saveToMemory(std::vector<uint8_t> &out) {
+  auto start = std::chrono::steady_clock::now();
+  HuffmanMode mode = resolveHuffmanMode();
+
+  std::vector<RestartBand> bands;
+  if (mode != HuffmanMode::Optimized &&
+      splitIntoBands(restartInterval, bands)) {
+    if (!encodeRestartBands(bands, mode, out))
+      return false;
+    recordSave(mode, out.size(), start);
+    return true;
+  }
 
-std::vector<int> Jpeg::extractDC(bool isLuminance) {
-  std::vector<int> dcCoefficients;
+  beginCompress();
+  VectorDestination dest{};
+  dest.pub.init_destination = vectorInitDestination;
+  dest.pub.empty_output_buffer = vectorEmptyOutputBuffer;
+  dest.pub.term_destination = vectorTermDestination;
+  dest.out = &out;
+  dout.dest = &dest.pub;
+  bool ok = writeCoefficients(mode);
+  dout.dest = nullptr; // dest lives on this stack frame
+  if (ok)
+    recordSave(mode, out.size(), start);
+  return ok;
+}
 
-  for (int comp = 0; comp < din.num_components; comp++) {
-    if (isLuminance && comp > 0)
-      continue; // Skip chrominance
-    if (!isLuminance && comp == 0)
-      continue; // Skip luminance
+void Jpeg::beginCompress() {
+  jpeg_abort_compress(&dout);
+  context->restoreStandardTables();
+}
 
-    auto *ci = din.comp_info + comp;
-    int rows = ci->height_in_blocks;
-    int cols = ci->width_in_blocks;
+bool Jpeg::writeCoefficients(HuffmanMode mode) {
+  if (setjmp(jerr.jump)) {
+    jpeg_abort_compress(&dout);
+    return false;
+  }
 
-    for (int r = 0; r < rows; ++r) {
-      JBLOCKARRAY row = din.mem->access_virt_barray((j_common_ptr)&din,
-                                                    coeffs[comp], r, 1, TRUE);
-      for (int c = 0; c < cols; ++c) {
-        JCOEFPTR block = row[0][c];
-        dcCoefficients.push_back(block[0]); // Extract DC coefficient
+  if (dumpFile)
+    copyDumpToArrays();
+  jpeg_copy_critical_parameters(&din, &dout);
+  dout.restart_interval = restartInterval;
+  if (mode == HuffmanMode::Original)
+    copyHuffmanTables(din, dout);
+  dout.optimize_coding = mode == HuffmanMode::Optimized ? TRUE : FALSE;
+
+  // Progressive output keeps the input's scan script when it has one
+  std::vector<jpeg_scan_info> script;
+  if (progressiveOutput()) {
+    if (scanMode == ScanMode::Source && sourceScriptUsable) {
+      for (const ScanInfo &scan : scanList) {
+        jpeg_scan_info info{};
+        info.comps_in_scan = static_cast<int>(scan.components.size());
+        for (int i = 0; i < info.comps_in_scan; ++i)
+          info.component_index[i] = scan.components[i];
+        info.Ss = scan.ss;
+        info.Se = scan.se;
+        info.Ah = scan.ah;
+        info.Al = scan.al;
+        script.push_back(info);
       }
+      dout.scan_info = script.data();
+      dout.num_scans = static_cast<int>(script.size());
+    } else {
+      jpeg_simple_progression(&dout);
     }
   }
+  jpeg_write_coefficients(&dout, coeffs);
+  if (!tag.empty()) {
+    std::string text = tagPrefix + tag;
+    jpeg_write_marker(&dout, JPEG_COM,
+                      reinterpret_cast<const JOCTET *>(text.data()),
+                      static_cast<unsigned>(text.size()));
+  }
+  jpeg_finish_compress(&dout);
+  // din is left as is: the coefficients stay valid for further saves and
+  // are released by the next load (or when the context returns to the pool)
+  return true;
+}
 
-  // std::cout << "Extracted " << dcCoefficients.size() << " DC
-  // coefficients.\n";
-  return dcCoefficients;
+Jpeg::HuffmanMode Jpeg::resolveHuffmanMode() const {
+  // libjpeg always builds optimal tables for progressive output
+  if (progressiveOutput())
+    return HuffmanMode::Optimized;
+  if (huffmanMode == HuffmanMode::Original && !originalTablesCover())
+    return HuffmanMode::Standard;
+  return huffmanMode;
 }
 
-void Jpeg::applyDC(const std::vector<int> &dcCoefficients, bool isLuminance) {
-  int index = 0;
+bool Jpeg::originalTablesCover() const {
+  // Symbols each table has to code: DC magnitude categories and AC
+  // run/size pairs, gathered in the order the encoder visits the blocks
+  bool dcUsed[NUM_HUFF_TBLS][256] = {};
+  bool acUsed[NUM_HUFF_TBLS][256] = {};
+
+  const bool interleaved = din.num_components > 1;
+  size_t mcusPerRow, mcuRows;
+  if (interleaved) {
+    size_t mcuWidth = din.max_h_samp_factor * DCTSIZE;
+    size_t mcuHeight = din.max_v_samp_factor * DCTSIZE;
+    mcusPerRow = (din.image_width + mcuWidth - 1) / mcuWidth;
+    mcuRows = (din.image_height + mcuHeight - 1) / mcuHeight;
+  } else {
+    mcusPerRow = din.comp_info[0].width_in_blocks;
+    mcuRows = din.comp_info[0].height_in_blocks;
+  }
 
-  for (int comp = 0; comp < din.num_components; comp++) {
-    if (isLuminance && comp > 0)
-      continue; // Skip chrominance
-    if (!isLuminance && comp == 0)
-      continue; // Skip luminance
+  size_t mcuRowBytes = 0;
+  for (int comp = 0; comp < din.num_components; comp++)
+    mcuRowBytes += size_t(din.comp_info[comp].width_in_blocks) *
+                   din.comp_info[comp].height_in_blocks * sizeof(JBLOCK);
+  mcuRowBytes /= std::max<size_t>(mcuRows, 1);
+
+  std::vector<int> lastDc(din.num_components, 0);
+  size_t mcu = 0;
+  for (size_t my = 0; my < mcuRows; ++my) {
+    noteCoefficientAccess(mcuRowBytes);
+    for (size_t mx = 0; mx < mcusPerRow; ++mx, ++mcu) {
+      if (restartInterval && mcu % restartInterval == 0)
+        std::fill(lastDc.begin(), lastDc.end(), 0);
+
+      for (int comp = 0; comp < din.num_components; comp++) {
+        auto *ci = din.comp_info + comp;
+        int dcTable = ci->dc_tbl_no, acTable = ci->ac_tbl_no;
+        if (dcTable < 0 || dcTable >= NUM_HUFF_TBLS || acTable < 0 ||
+            acTable >= NUM_HUFF_TBLS)
+          return false;
+        size_t h = interleaved ? ci->h_samp_factor : 1;
+        size_t v = interleaved ? ci->v_samp_factor : 1;
+
+        for (size_t y = 0; y < v; ++y) {
+          for (size_t x = 0; x < h; ++x) {
+            size_t row = my * v + y, col = mx * h + x;
+            if (row >= ci->height_in_blocks || col >= ci->width_in_blocks) {
+              // Edge padding: a copy of the previous DC and no AC
+              dcUsed[dcTable][0] = true;
+              acUsed[acTable][0x00] = true;
+              continue;
+            }
+
+            const JCOEF *block = blockRows[comp][row][col];
+            dcUsed[dcTable][magnitudeBits(block[0] - lastDc[comp])] = true;
+            lastDc[comp] = block[0];
+
+            int run = 0;
+            for (int k = 1; k < DCTSIZE2; ++k) {
+              int value = block[zigzagOrder[k]];
+              if (value == 0) {
+                ++run;
+                continue;
+              }
+              for (; run > 15; run -= 16)
+                acUsed[acTable][0xF0] = true; // ZRL
+              int bits = std::min(magnitudeBits(value), 15);
+              acUsed[acTable][(run << 4) | bits] = true;
+              run = 0;
+            }
+            if (run > 0)
+              acUsed[acTable][0x00] = true; // EOB
+          }
+        }
+      }
+    }
+  }
 
-    auto *ci = din.comp_info + comp;
-    int rows = ci->height_in_blocks;
-    int cols = ci->width_in_blocks;
+  for (int t = 0; t < NUM_HUFF_TBLS; ++t) {
+    if (!tableCodes(din.dc_huff_tbl_ptrs[t], dcUsed[t], 256) ||
+        !tableCodes(din.ac_huff_tbl_ptrs[t], acUsed[t], 256))
+      return false;
+  }
+  return true;
+}
 
-    for (int r = 0; r < rows; ++r) {
-      JBLOCKARRAY row = din.mem->access_virt_barray((j_common_ptr)&din,
-                                                    coeffs[comp], r, 1, TRUE);
-      for (int c = 0; c < cols; ++c) {
-        if (index >= dcCoefficients.size()) {
-          std::cerr << "Error: DC coefficient index out of range. index="
-                    << index << ", size=" << dcCoefficients.size() << "\n";
-          return;
+void Jpeg::recordSave(HuffmanMode mode, size_t outputBytes,
+                      std::chrono::steady_clock::time_point start) {
+  saveStats.mode = mode;
+  saveStats.inputBytes = inputBytes;
+  saveStats.outputBytes = outputBytes;
+  saveStats.encodeMs = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+}
+
+bool Jpeg::encodeRestartBands(const std::vector<RestartBand> &bands,
+                              HuffmanMode mode, std::vector<uint8_t> &out) {
+  std::vector<std::vector<uint8_t>> encoded(bands.size());
+  std::atomic<bool> ok{true};
+  ThreadPool::global().parallelFor(
+      0, static_cast<int>(bands.size()), 1, [&](int first, int last) {
+        for (int i = first; i < last && ok; ++i) {
+          auto bandContext = JpegContextPool::global().acquire();
+          if (!encodeBand(*bandContext, din, blockRows, bands[i].firstMcuRow,
+                          bands[i].height, restartInterval,
+                          mode == HuffmanMode::Original, encoded[i]))
+            ok = false;
         }
+      });
+  if (!ok)
+    return false;
 
-        JCOEFPTR block = row[0][c];
-        block[0] = dcCoefficients[index++]; // Apply modified DC coefficient
+  // Headers of the first band (with the full height), then the segments of
+  // every band renumbered into one run of RST markers
+  out.clear();
+  int nextRestart = 0;
+  for (size_t i = 0; i < encoded.size(); ++i) {
+    const uint8_t *band = encoded[i].data();
+    ScanLayout layout;
+    if (!indexRestartSegments(band, encoded[i].size(), layout))
+      return false;
+    if (i == 0) {
+      out.assign(band, band + layout.dataOffset);
+      out[layout.sofOffset + 5] = static_cast<uint8_t>(din.image_height >> 8);
+      out[layout.sofOffset + 6] = static_cast<uint8_t>(din.image_height);
+      if (!tag.empty()) {
+        // The bands were encoded without it. It goes where
+        // jpeg_write_marker puts it on the serial path: after SOI and the
+        // JFIF/Adobe APPn headers, before the first table.
+        size_t at = 2;
+        while (at + 4 <= layout.sofOffset && out[at] == 0xFF &&
+               out[at + 1] >= JPEG_APP0 && out[at + 1] <= JPEG_APP0 + 15)
+          at += 2 + (size_t(out[at + 2]) << 8 | out[at + 3]);
+        std::string text = tagPrefix + tag;
+        size_t length = text.size() + 2;
+        std::vector<uint8_t> segment = {0xFF, JPEG_COM,
+                                        static_cast<uint8_t>(length >> 8),
+                                        static_cast<uint8_t>(length)};
+        segment.insert(segment.end(), text.begin(), text.end());
+        out.insert(out.begin() + at, segment.begin(), segment.end());
       }
+    } else {
+      appendRestartMarker(out, nextRestart);
+      nextRestart = (nextRestart + 1) & 7;
     }
+    nextRestart = appendRenumbered(out, band + layout.segments.front().first,
+                                   band + layout.segments.back().second,
+                                   nextRestart);
   }
+  out.push_back(0xFF);
+  out.push_back(0xD9);
+  return true;
 }
 
-std::vector<std::vector<int>> Jpeg::extractAC(bool isLuminance) {
-  std::vector<std::vector<int>> acCoefficients;
-
-  for (int comp = 0; comp < din.num_components; comp++) {
-    if (isLuminance && comp > 0)
-      continue; // Skip chrominance
-    if (!isLuminance && comp == 0)
-      continue; // Skip luminance
+Jpeg::CoefficientSnapshot Jpeg::snapshotCoefficients() const {
+  CoefficientSnapshot snapshot;
+  snapshot.components.resize(comps);
 
+  for (int comp = 0; comp < comps; comp++) {
     auto *ci = din.comp_info + comp;
-    int rows = ci->height_in_blocks;
-    int cols = ci->width_in_blocks;
+    const size_t rowValues = size_t(ci->width_in_blocks) * DCTSIZE2;
+    auto &plane = snapshot.components[comp];
+    plane.resize(rowValues * ci->height_in_blocks);
 
-    for (int r = 0; r < rows; ++r) {
-      JBLOCKARRAY row = din.mem->access_virt_barray((j_common_ptr)&din,
-                                                    coeffs[comp], r, 1, TRUE);
-      for (int c = 0; c < cols; ++c) {
-        JCOEFPTR block = row[0][c];
-        std::vector<int> acBlock;
+    for (JDIMENSION r = 0; r < ci->height_in_blocks; ++r)
+      std::memcpy(plane.data() + r * rowValues, blockRows[comp][r],
+                  rowValues * sizeof(JCOEF));
+  }
+  return snapshot;
+}
 
-        for (int i = 1; i < DCTSIZE2; ++i) {
-          acBlock.push_back(block[i]); // Extract AC coefficients
-        }
+bool Jpeg::matchesSnapshot(const CoefficientSnapshot &snapshot,
+                           BlockPosition *firstMismatch) const {
+  if (snapshot.components.size() != static_cast<size_t>(comps))
+    return false;
 
-        acCoefficients.push_back(acBlock);
+  for (int comp = 0; comp < comps; comp++) {
+    auto *ci = din.comp_info + comp;
+    const size_t rowValues = size_t(ci->width_in_blocks) * DCTSIZE2;
+    const auto &plane = snapshot.components[comp];
+    if (plane.size() != rowValues * ci->height_in_blocks)
+      return false;
+
+    for (JDIMENSION r = 0; r < ci->height_in_blocks; ++r) {
+      // Whole rows first: memcmp is vectorized and almost every row matches
+      const JCOEF *expected = plane.data() + r * rowValues;
+      const JCOEF *actual = blockRows[comp][r][0];
+      if (std::memcmp(expected, actual, rowValues * sizeof(JCOEF)) == 0)
+        continue;
+
+      if (firstMismatch) {
+        JDIMENSION c = 0;
+        while (c + 1 < ci->width_in_blocks &&
+               std::memcmp(expected + c * DCTSIZE2, actual + c * DCTSIZE2,
+                           sizeof(JBLOCK)) == 0)
+          ++c;
+        *firstMismatch = {comp, static_cast<int>(r), static_cast<int>(c)};
       }
+      return false;
     }
   }
+  return true;
+}
 
-  return acCoefficients;
+int Jpeg::getWidth() const { return width; }
+int Jpeg::getHeight() const { return height; }
+int Jpeg::getComponents() const { return comps; }
+
+int Jpeg::blockCount(bool isLuminance) const {
+  size_t count = 0;
+  for (size_t comp = isLuminance ? 0 : 1; comp < selectedBlocks.size();
+       comp++) {
+    count += selectedBlocks[comp];
+    if (isLuminance)
+      break;
+  }
+  return int(count);
 }
 
-void Jpeg::applyAC(const std::vector<std::vector<int>> &acCoefficients,
-                   bool isLuminance) {
-  int index = 0;
+std::vector<int> Jpeg::extractDC(bool isLuminance) {
+  std::vector<int> dcCoefficients;
+  dcCoefficients.reserve(blockCount(isLuminance));
+  forEachLaneBlock(isLuminance, [&](JCOEFPTR block) {
+    dcCoefficients.push_back(block[0]); // Extract DC coefficient
+  });
+  return dcCoefficients;
+}
 
-  for (int comp = 0; comp < din.num_components; comp++) {
-    if (isLuminance && comp > 0)
-      continue; // Skip chrominance
-    if (!isLuminance && comp == 0)
-      continue; // Skip luminance
+void Jpeg::applyDC(const std::vector<int> &dcCoefficients, bool isLuminance) {
+  if (dcCoefficients.size() < size_t(blockCount(isLuminance))) {
+    std::cerr << "Error: DC coefficient index out of range. size="
+              << dcCoefficients.size() << "\n";
+    return;
+  }
 
-    auto *ci = din.comp_info + comp;
-    int rows = ci->height_in_blocks;
-    int cols = ci->width_in_blocks;
+  size_t index = 0;
+  forEachLaneBlock(isLuminance, [&](JCOEFPTR block) {
+    block[0] = dcCoefficients[index++]; // Apply modified DC coefficient
+  });
+}
 
-    for (int r = 0; r < rows; ++r) {
-      JBLOCKARRAY row = din.mem->access_virt_barray((j_common_ptr)&din,
-                                                    coeffs[comp], r, 1, TRUE);
-      for (int c = 0; c < cols; ++c) {
-        JCOEFPTR block = row[0][c];
-        const auto &acBlock = acCoefficients[index++];
+std::vector<std::vector<int>> Jpeg::extractAC(bool isLuminance) {
+  std::vector<std::vector<int>> acCoefficients;
+  forEachLaneBlock(isLuminance, [&](JCOEFPTR block) {
+    // Extract AC coefficients
+    acCoefficients.emplace_back(block + 1, block + DCTSIZE2);
+  });
+  return acCoefficients;
+}
 
-        // Only iterate through the actual number of AC values in the block
-        for (size_t i = 0; i < acBlock.size(); ++i) {
-          block[i + 1] = acBlock[i]; // Apply modified AC coefficients
-        }
-      }
+void Jpeg::applyAC(const std::vector<std::vector<int>> &acCoefficients,
+                   bool isLuminance) {
+  size_t index = 0;
+  forEachLaneBlock(isLuminance, [&](JCOEFPTR block) {
+    const auto &acBlock = acCoefficients[index++];
+
+    // Only iterate through the actual number of AC values in the block
+    for (size_t i = 0; i < acBlock.size(); ++i) {
+      block[i + 1] = acBlock[i]; // Apply modified AC coefficients
     }
-  }
+  });
 }
 
 std::vector<int> Jpeg::substituteDC(const std::vector<int> &DC,
@@ -334,28 +1591,15 @@ std::vector<int> Jpeg::decryptDC(const std::vector<int> &DC_encrypted,
 }
 
 std::vector<std::vector<int>>
-Jpeg::generateACPermutationKeys(bool isLuminance,
-                                const ChaoticSystems::MasterKey &key) {
-
-  auto acBlocks = extractAC(isLuminance);
-  std::vector<std::vector<int>> keys;
-
-  for (size_t blockIndex = 0; blockIndex < acBlocks.size(); ++blockIndex) {
-    const auto &block = acBlocks[blockIndex];
-    std::vector<int> zeroGroupIndices;
-    auto groups = extractACGroups(block, zeroGroupIndices);
-    int nonZeroGroupCount = groups.size() - zeroGroupIndices.size();
-
-    if (nonZeroGroupCount <= 1) {
-      keys.emplace_back();
-      continue;
-    }
-
-    // Use master key's Jia keystream (use blockIndex as offset/seed)
+Jpeg::generateACIntraBlockKeys(const ChaoticSystems::MasterKey &key) {
+  // A block has at most 63 non-zero groups; with one or none there is
+  // nothing to shuffle and the key stays empty
+  std::vector<std::vector<int>> keys(DCTSIZE2);
+  for (int nonZeroGroupCount = 2; nonZeroGroupCount < DCTSIZE2;
+       ++nonZeroGroupCount) {
     //auto jiaKS = key.generateJiaKeystream(nonZeroGroupCount - 1);
     auto jiaKS = key.generateArnoldKeystream(nonZeroGroupCount - 1);
 
-
     std::vector<int> perm(nonZeroGroupCount - 1);
     for (int i = 0; i < nonZeroGroupCount - 2; ++i) {
       double sm = std::fabs(jiaKS[i]);
@@ -363,46 +1607,44 @@ Jpeg::generateACPermutationKeys(bool isLuminance,
                    (nonZeroGroupCount - i);
       perm[i] = i + offset;
     }
-
-    keys.push_back(perm);
+    keys[nonZeroGroupCount] = std::move(perm);
   }
-
   return keys;
 }
 
+// The AC blocks are swapped in place in the coefficient arrays: a copy of
+// the whole set would double the memory of the stage
 void Jpeg::permuteACBlocks(bool isLuminance, const std::vector<int> &keys) {
-  auto acBlocks = extractAC(isLuminance);
-
-  int N = acBlocks.size();
+  int N = blockCount(isLuminance);
   for (int i = 0; i < N - 1; ++i) {
+    if (i % swapsPerNote == 0)
+      noteCoefficientAccess(swapsPerNote * 2 * faultBytes);
     int j = keys[i];
     if (j >= N) {
       std::cerr << "Warning: Key index out of bounds during AC block "
                    "permutation. Skipping swap.\n";
       continue;
     }
-    std::swap(acBlocks[i], acBlocks[j]); // Swap entire blocks
+    JCOEFPTR a = laneBlock(isLuminance, i);
+    std::swap_ranges(a + 1, a + DCTSIZE2, laneBlock(isLuminance, j) + 1);
   }
-
-  applyAC(acBlocks, isLuminance);
 }
 
 void Jpeg::reversePermuteACBlocks(bool isLuminance,
                                   const std::vector<int> &keys) {
-  auto acBlocks = extractAC(isLuminance);
-
-  int N = acBlocks.size();
+  int N = blockCount(isLuminance);
   for (int i = N - 2; i >= 0; --i) {
+    if (i % swapsPerNote == 0)
+      noteCoefficientAccess(swapsPerNote * 2 * faultBytes);
     int j = keys[i];
     if (j >= N) {
       std::cerr << "Warning: Key index out of bounds during reverse AC block "
                    "permutation. Skipping swap.\n";
       continue;
     }
-    std::swap(acBlocks[i], acBlocks[j]); // Reverse swap entire blocks
+    JCOEFPTR a = laneBlock(isLuminance, i);
+    std::swap_ranges(a + 1, a + DCTSIZE2, laneBlock(isLuminance, j) + 1);
   }
-
-  applyAC(acBlocks, isLuminance);
 }
 
 std::vector<std::vector<int>>
@@ -509,92 +1751,85 @@ int Jpeg::calculateLeadingZeroGroups(
 void Jpeg::processACIntraBlock(bool isLuminance,
                                const std::vector<std::vector<int>> &intraKeys,
                                bool reverse) {
-  auto acBlocks = extractAC(isLuminance);
-
-  for (size_t blockIndex = 0; blockIndex < acBlocks.size(); ++blockIndex) {
-    auto &block = acBlocks[blockIndex];
-    const auto &intraKey = intraKeys[blockIndex];
-
-    std::vector<int> zeroGroupIndices;
-    auto groups = extractACGroups(block, zeroGroupIndices);
-    auto nonZeroGroups = removeZeroGroups(groups, zeroGroupIndices);
-
-    if (reverse) {
-      // First round reverse shuffle
-      unshuffleGroups(nonZeroGroups, intraKey);
-
-      // Reinsert zeros (round 1 done)
-      reinsertZeroGroups(nonZeroGroups, zeroGroupIndices, groups);
-
-      // Extract groups again (for second round)
-      std::vector<int> zeroGroupIndices2;
-      auto groups2 =
-          extractACGroups(flattenGroups(nonZeroGroups), zeroGroupIndices2);
-      auto nonZeroGroups2 = removeZeroGroups(groups2, zeroGroupIndices2);
-
-      // Second round reverse shuffle
-      if (!nonZeroGroups2.empty()) {
-        unshuffleGroups(nonZeroGroups2, intraKey);
-      }
-
-      // Final reinsertion
-      reinsertZeroGroups(nonZeroGroups2, zeroGroupIndices2, groups2);
-      block = flattenGroups(nonZeroGroups2);
-    } else {
-      // First round shuffle
-      shuffleGroups(nonZeroGroups, intraKey);
-
-      // Reinsert zeros (round 1 done)
-      reinsertZeroGroups(nonZeroGroups, zeroGroupIndices, groups);
-
-      // Extract groups again (for second round)
-      std::vector<int> zeroGroupIndices2;
-      auto groups2 =
-          extractACGroups(flattenGroups(nonZeroGroups), zeroGroupIndices2);
-      auto nonZeroGroups2 = removeZeroGroups(groups2, zeroGroupIndices2);
-
-      // Second round shuffle
-      if (!nonZeroGroups2.empty()) {
-        shuffleGroups(nonZeroGroups2, intraKey);
-      }
-
-      // Final reinsertion
-      reinsertZeroGroups(nonZeroGroups2, zeroGroupIndices2, groups2);
-      block = flattenGroups(nonZeroGroups2);
-    }
-  }
+  // Blocks are shuffled independently of each other, each one read from
+  // and written back to the coefficient arrays by the task that owns it
+  ThreadPool::global().parallelFor(
+      0, blockCount(isLuminance), 256, [&](size_t first, size_t last) {
+        std::vector<int> block;
+        for (size_t blockIndex = first; blockIndex < last; ++blockIndex) {
+          // A chunk can be a whole lane when the pool is small
+          if ((blockIndex - first) % blocksPerNote == 0)
+            noteCoefficientAccess(
+                std::min(blocksPerNote, last - blockIndex) * sizeof(JBLOCK));
+          JCOEFPTR coefficients = laneBlock(isLuminance, blockIndex);
+          block.assign(coefficients + 1, coefficients + DCTSIZE2);
+
+          std::vector<int> zeroGroupIndices;
+          auto groups = extractACGroups(block, zeroGroupIndices);
+          auto nonZeroGroups = removeZeroGroups(groups, zeroGroupIndices);
+          // The count is the same before and after the shuffle, so both
+          // directions pick the same key
+          const auto &intraKey = intraKeys[nonZeroGroups.size()];
+
+          if (reverse) {
+            // First round reverse shuffle
+            unshuffleGroups(nonZeroGroups, intraKey);
+
+            // Reinsert zeros (round 1 done)
+            reinsertZeroGroups(nonZeroGroups, zeroGroupIndices, groups);
+
+            // Extract groups again (for second round)
+            std::vector<int> zeroGroupIndices2;
+            auto groups2 = extractACGroups(flattenGroups(nonZeroGroups),
+                                           zeroGroupIndices2);
+            auto nonZeroGroups2 = removeZeroGroups(groups2, zeroGroupIndices2);
+
+            // Second round reverse shuffle
+            if (!nonZeroGroups2.empty()) {
+              unshuffleGroups(nonZeroGroups2, intraKey);
+            }
+
+            // Final reinsertion
+            reinsertZeroGroups(nonZeroGroups2, zeroGroupIndices2, groups2);
+            block = flattenGroups(nonZeroGroups2);
+          } else {
+            // First round shuffle
+            shuffleGroups(nonZeroGroups, intraKey);
+
+            // Reinsert zeros (round 1 done)
+            reinsertZeroGroups(nonZeroGroups, zeroGroupIndices, groups);
+
+            // Extract groups again (for second round)
+            std::vector<int> zeroGroupIndices2;
+            auto groups2 = extractACGroups(flattenGroups(nonZeroGroups),
+                                           zeroGroupIndices2);
+            auto nonZeroGroups2 = removeZeroGroups(groups2, zeroGroupIndices2);
+
+            // Second round shuffle
+            if (!nonZeroGroups2.empty()) {
+              shuffleGroups(nonZeroGroups2, intraKey);
+            }
+
+            // Final reinsertion
+            reinsertZeroGroups(nonZeroGroups2, zeroGroupIndices2, groups2);
+            block = flattenGroups(nonZeroGroups2);
+          }
 
-  applyAC(acBlocks, isLuminance);
+          // Groups end at a non-zero value, so the trailing zeros are
+          // not part of them and stay where they are
+          std::copy(block.begin(), block.end(), coefficients + 1);
+        }
+      });
 }
 
 void Jpeg::applyNonZeroAC(const std::vector<int> &encryptedAC,
                           bool isLuminance) {
-  int acIndex = 0;
-
-  for (int comp = 0; comp < din.num_components; comp++) {
-    if (isLuminance && comp > 0)
-      continue;
-    if (!isLuminance && comp == 0)
-      continue;
-
-    auto *ci = din.comp_info + comp;
-    int rows = ci->height_in_blocks;
-    int cols = ci->width_in_blocks;
-
-    for (int r = 0; r < rows; ++r) {
-      JBLOCKARRAY row = din.mem->access_virt_barray((j_common_ptr)&din,
-                                                    coeffs[comp], r, 1, TRUE);
-      for (int c = 0; c < cols; ++c) {
-        JCOEFPTR block = row[0][c];
-
-        for (int i = 1; i < DCTSIZE2; ++i) { // i = 1 to 63 (AC coeffs)
-          if (block[i] != 0) {
-            block[i] = encryptedAC[acIndex++];
-          }
-        }
-      }
-    }
-  }
+  size_t acIndex = 0;
+  forEachNonZeroAC(isLuminance, [&](JCOEF &coefficient) {
+    if (acIndex < encryptedAC.size())
+      coefficient = encryptedAC[acIndex];
+    ++acIndex;
+  });
 
   if (acIndex != encryptedAC.size()) {
     std::cerr
@@ -602,26 +1837,29 @@ void Jpeg::applyNonZeroAC(const std::vector<int> &encryptedAC,
   }
 }
 
-void Jpeg::substituteACInterBlock(
-    bool isLuminance, const std::vector<double> &logisticKeyStream) {
-
-  auto acBlocks = extractAC(isLuminance);
-
-  std::vector<int> allAC;
-  std::vector<int> zeroGroupIndices;
+size_t Jpeg::countNonZeroAC(bool isLuminance) {
+  size_t count = 0;
+  forEachNonZeroAC(isLuminance, [&count](JCOEF &) { ++count; });
+  return count;
+}
 
-  for (const auto &block : acBlocks) {
-    auto groups = extractACGroups(block, zeroGroupIndices);
-    for (const auto &group : groups) {
-      for (int coeff : group) {
-        if (coeff != 0) {
-          allAC.push_back(coeff);
-        }
-      }
+template <typename Visit>
+void Jpeg::forEachNonZeroAC(bool isLuminance, Visit &&visit) {
+  forEachLaneBlock(isLuminance, [&visit](JCOEFPTR block) {
+    for (int k = 1; k < DCTSIZE2; ++k) {
+      if (block[k] != 0)
+        visit(block[k]);
     }
-  }
+  });
+}
 
-  int n = allAC.size();
+// The non-zero AC values form one chain in block order; both directions
+// walk the coefficient arrays twice (count, then substitute in place)
+// instead of gathering the chain into a copy
+void Jpeg::substituteACInterBlock(
+    bool isLuminance, const std::vector<double> &logisticKeyStream) {
+
+  size_t n = countNonZeroAC(isLuminance);
   if (n == 0) {
     std::cerr << "Warning: No non-zero AC coefficients found.\n";
     return;
@@ -632,12 +1870,12 @@ void Jpeg::substituteACInterBlock(
     return;
   }
 
-  std::vector<int> encryptedAC(n);
+  int i = 0;
   int sign_c_prev = 0;
   int mag_c_prev = 0;
 
-  for (int i = 0; i < n; ++i) {
-    int val = allAC[i];
+  forEachNonZeroAC(isLuminance, [&](JCOEF &coefficient) {
+    int val = coefficient;
     int sign = (val < 0) ? 1 : 0;
     int abs_val = std::abs(val);
 
@@ -645,9 +1883,10 @@ void Jpeg::substituteACInterBlock(
       int64_t key_bit = extractSignificantDigits(logisticKeyStream[i], 1) & 1;
       int sign_c = key_bit ^ sign_c_prev ^ sign;
       sign_c_prev = sign_c;
-      encryptedAC[i] = (sign_c == 1) ? -1 : 1;
+      coefficient = (sign_c == 1) ? -1 : 1;
       mag_c_prev = 1;
-      continue;
+      ++i;
+      return;
     }
 
     int bitLen = static_cast<int>(std::floor(std::log2(abs_val))) + 1;
@@ -672,32 +1911,15 @@ void Jpeg::substituteACInterBlock(
     }
 
     mag_c_prev = new_mag;
-    encryptedAC[i] = (sign_c == 1) ? -new_mag : new_mag;
-  }
-
-  applyNonZeroAC(encryptedAC, isLuminance);
+    coefficient = (sign_c == 1) ? -new_mag : new_mag;
+    ++i;
+  });
 }
 
 void Jpeg::reverseSubstituteACInterBlock(
     bool isLuminance, const std::vector<double> &logisticKeyStream) {
 
-  auto acBlocks = extractAC(isLuminance);
-
-  std::vector<int> allAC;
-  std::vector<int> zeroGroupIndices;
-
-  for (const auto &block : acBlocks) {
-    auto groups = extractACGroups(block, zeroGroupIndices);
-    for (const auto &group : groups) {
-      for (int coeff : group) {
-        if (coeff != 0) {
-          allAC.push_back(coeff);
-        }
-      }
-    }
-  }
-
-  int n = allAC.size();
+  size_t n = countNonZeroAC(isLuminance);
   if (n == 0) {
     std::cerr << "Warning: No non-zero AC coefficients found.\n";
     return;
@@ -708,12 +1930,12 @@ void Jpeg::reverseSubstituteACInterBlock(
     return;
   }
 
-  std::vector<int> decryptedAC(n);
+  int i = 0;
   int sign_c_prev = 0;
   int mag_c_prev = 0;
 
-  for (int i = 0; i < n; ++i) {
-    int val_c = allAC[i];
+  forEachNonZeroAC(isLuminance, [&](JCOEF &coefficient) {
+    int val_c = coefficient;
     int sign_c = (val_c < 0) ? 1 : 0;
     int abs_c = std::abs(val_c);
 
@@ -722,9 +1944,10 @@ void Jpeg::reverseSubstituteACInterBlock(
       int key_bit = sig % 2;
       int sign_p = key_bit ^ sign_c_prev ^ sign_c;
       sign_c_prev = sign_c;
-      decryptedAC[i] = (sign_p == 1) ? -1 : 1;
+      coefficient = (sign_p == 1) ? -1 : 1;
       mag_c_prev = 1;
-      continue;
+      ++i;
+      return;
     }
 
     int bitLen = static_cast<int>(std::floor(std::log2(abs_c))) + 1;
@@ -749,16 +1972,49 @@ void Jpeg::reverseSubstituteACInterBlock(
       unmasked = high_bit;
     }
 
-    decryptedAC[i] = (sign_p == 1) ? -unmasked : unmasked;
+    coefficient = (sign_p == 1) ? -unmasked : unmasked;
     mag_c_prev = abs_c;
+    ++i;
+  });
+}
+
+void Jpeg::substituteACSigns(bool isLuminance,
+                             const std::vector<double> &logisticKeyStream,
+                             int alpha) {
+  chainACSigns(isLuminance, logisticKeyStream, alpha, false);
+}
+
+void Jpeg::reverseSubstituteACSigns(
+    bool isLuminance, const std::vector<double> &logisticKeyStream,
+    int alpha) {
+  chainACSigns(isLuminance, logisticKeyStream, alpha, true);
+}
+
+// Cipher sign = key bit ^ plain sign ^ previous cipher sign, so a change
+// spreads along the chain; the inverse undoes it with the same bits
+void Jpeg::chainACSigns(bool isLuminance, const std::vector<double> &keystream,
+                        int alpha, bool reverse) {
+  if (keystream.size() < countNonZeroAC(isLuminance)) {
+    std::cerr << "Error: Logistic keystream too short.\n";
+    return;
   }
 
-  applyNonZeroAC(decryptedAC, isLuminance);
+  size_t i = 0;
+  int previous = 0;
+  forEachNonZeroAC(isLuminance, [&](JCOEF &coefficient) {
+    int keyBit = extractSignificantDigits(keystream[i++], alpha) & 1;
+    int sign = coefficient < 0 ? 1 : 0;
+    int flipped = keyBit ^ previous ^ sign;
+    previous = reverse ? sign : flipped; // the cipher sign
+    if (flipped != sign)
+      coefficient = -coefficient;
+  });
 }
 
 std::vector<int> Jpeg::generateACInterBlockPermutationKey(
     int numBlocks, int alpha, const std::vector<double> &logisticKS) {
   std::vector<int> permKey;
+  permKey.reserve(std::max(numBlocks - 1, 0));
 
   for (int m = 0; m < numBlocks - 1; ++m) {
     double sm = std::fabs(logisticKS[m]);
@@ -1,26 +1,184 @@
 #pragma once
 #include <stdio.h> // Ensure FILE is defined
+#include <chrono>
+#include <cstdint>
 #include <jpeglib.h>
+#include <memory>
 #include <string>
 #include <vector>
+#include "jpeg_context_pool.hpp"
 #include "master_key.hpp"
 
+class MappedFile;
+struct ScanLayout;
+
 class Jpeg {
 public:
-  // load from disk; returns false on error
+  // Borrows a libjpeg context from the shared pool for its lifetime
+  Jpeg();
+  ~Jpeg();
+
+  Jpeg(const Jpeg &) = delete;
+  Jpeg &operator=(const Jpeg &) = delete;
+
+  // Copy of every coefficient block, one contiguous plane per component
+  struct CoefficientSnapshot {
+    std::vector<std::vector<JCOEF>> components;
+  };
+
+  // Position of a coefficient block
+  struct BlockPosition {
+    int component = -1;
+    int row = -1;
+    int col = -1;
+  };
+
+  // What the headers of a file say about it, without any entropy decoding
+  struct ImageInfo {
+    struct Component {
+      int widthInBlocks = 0;
+      int heightInBlocks = 0;
+      int hSampling = 1;
+      int vSampling = 1;
+    };
+    int width = 0;
+    int height = 0;
+    bool progressive = false;
+    unsigned restartInterval = 0; // MCUs, 0 = no restart markers
+    std::vector<Component> components;
+    uint64_t blocks = 0; // coefficient blocks over all components
+    // Relative decode + cipher work: blocks, doubled for progressive files
+    // (decoded in several passes over the coefficient buffer)
+    uint64_t estimatedCost = 0;
+    // Estimated peak memory of loading and encrypting the image:
+    // coefficients (as far as the default memory limit keeps them in RAM),
+    // a band-decode copy for restart-marked files, and the keystreams of
+    // the cipher stages
+    uint64_t peakBytes = 0;
+  };
+
+  // Read only the file's headers (up to the first SOS) on a pooled
+  // context; returns false if it is not a readable JPEG
+  static bool probe(const std::wstring &path, ImageInfo &info);
+
+  // load from disk; returns false on error. Coefficient dumps (see
+  // coefficient_dump.hpp) load too: their blocks are used in place from a
+  // copy-on-write mapping of the file, without any entropy decoding.
   bool load(const std::wstring &path);
 
+  // load from a complete JPEG file held in memory; returns false on error
+  bool loadFromMemory(const uint8_t *data, size_t size);
+
   // process AC coefficients
   void processAC(bool isLuminance);
 
   // save back to disk with given quality
   bool save(const std::wstring &path, int quality = 90);
 
+  // save into a byte buffer (replacing its contents, reusing its capacity)
+  bool saveToMemory(std::vector<uint8_t> &out);
+
+  // Write the coefficients, tables and tag as a coefficient dump
+  bool saveDump(const std::wstring &path);
+
+  // Whether the image was loaded from a coefficient dump
+  bool isDump() const;
+
+  // Restart interval (MCUs) for saved files; 0, the default, writes no RST
+  // markers. With an interval, large images are entropy coded in parallel,
+  // one band of restart segments per task.
+  void setRestartInterval(unsigned mcus);
+
+  // Huffman tables for saved files
+  enum class HuffmanMode {
+    Standard,  // libjpeg's default tables (the default)
+    Original,  // the input's own tables, single pass; falls back to
+               // Standard when they lack a code the coefficients need
+    Optimized  // optimize_coding: an extra statistics pass, smallest output
+  };
+  void setHuffmanMode(HuffmanMode mode);
+  static const char *huffmanModeName(HuffmanMode mode);
+
+  // Coefficient bytes an image may keep in RAM; larger images are held in
+  // a memory-mapped temporary file instead (libjpeg's max_memory_to_use).
+  // 0, the default, means no limit. Takes effect at the next load.
+  void setMemoryLimit(size_t bytes);
+
+  // Limit given to every Jpeg created afterwards
+  static void setDefaultMemoryLimit(size_t bytes);
+
+  // Rectangle of the image in pixels
+  struct Region {
+    int x = 0, y = 0;
+    int width = 0, height = 0;
+  };
+
+  // Restrict every cipher stage to the blocks covering `regions`: in each
+  // component, the blocks any rectangle touches after chroma subsampling.
+  // The lanes (blockCount, DC/AC extraction and substitution, block
+  // permutation) then consist of these blocks only, so keystreams and
+  // cipher work scale with the protected area. An empty list, the default,
+  // selects the whole image. May be set before or after loading; a cipher
+  // graph must be built afterwards.
+  void setRegions(const std::vector<Region> &regions);
+
+  const std::vector<Region> &getRegions() const;
+
+  // Regions given to every Jpeg created afterwards; set before any image
+  // is created, as the list is not synchronized
+  static void setDefaultRegions(const std::vector<Region> &regions);
+
+  // Text kept in a COM segment marked as this program's (e.g. how an
+  // image was encrypted). Loading takes it from the file, saving writes it
+  // unless it is empty.
+  void setTag(const std::string &tag);
+  const std::string &getTag() const;
+
+  // Scan structure of saved files
+  enum class ScanMode {
+    Source,     // like the input: progressive files keep their scan script
+    Baseline,   // one sequential scan (fastest to decode and encode)
+    Progressive // libjpeg's standard progressive script
+  };
+  void setScanMode(ScanMode mode);
+
+  // One scan of the loaded file and the time spent decoding it
+  struct ScanInfo {
+    std::vector<int> components; // component indexes in the scan
+    int ss = 0, se = 63;         // spectral selection
+    int ah = 0, al = 0;          // successive approximation bit positions
+    double decodeMs = 0;
+  };
+
+  // Scans of the loaded file, in file order
+  const std::vector<ScanInfo> &scans() const;
+  bool isProgressive() const;
+
+  // Size and encode time of the last successful save
+  struct SaveStats {
+    HuffmanMode mode = HuffmanMode::Standard; // tables actually used
+    size_t inputBytes = 0;                    // loaded file, 0 if unknown
+    size_t outputBytes = 0;
+    double encodeMs = 0;
+  };
+  const SaveStats &lastSaveStats() const;
+
+  // Take a copy of all coefficients (e.g. before an encrypt/decrypt cycle)
+  CoefficientSnapshot snapshotCoefficients() const;
+
+  // Compare the coefficients with a snapshot; on mismatch returns false and
+  // stores the first differing block in *firstMismatch (if given)
+  bool matchesSnapshot(const CoefficientSnapshot &snapshot,
+                       BlockPosition *firstMismatch = nullptr) const;
+
   // accessors
   int getWidth() const;
   int getHeight() const;
   int getComponents() const;
 
+  // Number of 8x8 blocks in the luminance or chrominance components
+  int blockCount(bool isLuminance) const;
+
   // Extract DC coefficients into a 1D array
   std::vector<int> extractDC(bool isLuminance);
 
@@ -40,9 +198,11 @@ public:
   // Generate DC permutation key
   std::vector<int> generateDCPermutationKey(int lenDC, int alpha = 15);
 
-  // Generate AC permutation keystream
-  std::vector<std::vector<int>> generateACPermutationKeys(
-    bool isLuminance, const ChaoticSystems::MasterKey &key);
+  // Intra-block permutation keys, indexed by a block's number of non-zero
+  // AC groups: a block's key depends on the master key and that number
+  // only, so one table of at most 64 keys serves blocks of any image
+  static std::vector<std::vector<int>>
+  generateACIntraBlockKeys(const ChaoticSystems::MasterKey &key);
 
   // Generate AC permutation key using Jia chaotic map
   std::vector<int> generateACPermutationKey(int groupCount);
@@ -96,7 +256,8 @@ public:
   // Generate AC permutation keys for all AC blocks
   std::vector<std::vector<int>> generateACPermutationKeys(bool isLuminance);
 
-  // Process AC intra-block shuffling (forward or reverse) with 2D keys
+  // Process AC intra-block shuffling (forward or reverse), each block with
+  // the key of its non-zero group count (see generateACIntraBlockKeys)
   void processACIntraBlock(bool isLuminance, const std::vector<std::vector<int>>& intraKeys, bool reverse = false);
 
   void applyNonZeroAC(const std::vector<int>& encryptedAC, bool isLuminance);
@@ -107,14 +268,150 @@ public:
   // Reverse substitute AC coefficients inter-block with a provided logistic keystream
   void reverseSubstituteACInterBlock(bool isLuminance, const std::vector<double>& logisticKeyStream);
 
+  // Number of non-zero AC coefficients in the luminance or chrominance blocks
+  size_t countNonZeroAC(bool isLuminance);
+
+  // Flip the sign of every non-zero AC coefficient by a key bit chained
+  // with the previous cipher sign; magnitudes stay. The keystream needs
+  // one value per non-zero coefficient.
+  void substituteACSigns(bool isLuminance, const std::vector<double>& logisticKeyStream, int alpha = 15);
+  void reverseSubstituteACSigns(bool isLuminance, const std::vector<double>& logisticKeyStream, int alpha = 15);
+
 private:
-  // JPEG internals
-  jpeg_decompress_struct din{};
-  jpeg_compress_struct dout{};
-  jpeg_error_mgr jerr{};
+  // Return din/dout to their start state before a new load/save
+  void beginDecompress();
+  void beginCompress();
+
+  // Decode header and coefficients from the source attached to din;
+  // `data` is the whole file when it is in memory (enables parallel decode)
+  bool readCoefficients(const uint8_t *data = nullptr, size_t size = 0);
+
+  // Run of restart segments covering whole MCU rows, decoded as one unit
+  struct RestartBand {
+    size_t firstSegment = 0;
+    size_t lastSegment = 0; // exclusive
+    JDIMENSION firstMcuRow = 0;
+    unsigned height = 0; // pixel rows
+  };
+
+  // Split a restart-marked scan into bands for parallel decoding; returns
+  // false when the file does not qualify (or is too small to benefit)
+  bool planRestartBands(const uint8_t *data, size_t size, ScanLayout &layout,
+                        std::vector<RestartBand> &bands);
+
+  // Split the MCU rows of the loaded image into bands starting on restart
+  // boundaries of `interval`, about two per pool worker; false if the image
+  // is too small or the pool has a single worker
+  bool splitIntoBands(unsigned interval,
+                      std::vector<RestartBand> &bands) const;
+
+  // Decode the bands concurrently into coefficient arrays owned by din
+  bool decodeRestartBands(const uint8_t *data, const ScanLayout &layout,
+                          const std::vector<RestartBand> &bands);
+
+  // Encode the bands concurrently and join them into one JPEG file
+  bool encodeRestartBands(const std::vector<RestartBand> &bands,
+                          HuffmanMode mode, std::vector<uint8_t> &out);
+
+  // Encode the coefficients to the destination attached to dout
+  bool writeCoefficients(HuffmanMode mode);
+
+  // Take the image from a dump mapped copy-on-write: the header becomes
+  // din's tables and frame, the mapped planes the block rows
+  bool loadDump(std::unique_ptr<MappedFile> file);
+
+  // Request and realize coefficient arrays of the shape
+  // jpeg_read_coefficients gives them
+  void allocateCoefficients();
+
+  // For dumps, whose blocks live in the mapping: copy them into the
+  // coefficient arrays jpeg_write_coefficients reads
+  void copyDumpToArrays();
+
+  // Requested Huffman mode, with Original demoted to Standard if the
+  // input's tables cannot code the current coefficients
+  HuffmanMode resolveHuffmanMode() const;
+  bool originalTablesCover() const;
+
+  void recordSave(HuffmanMode mode, size_t outputBytes,
+                  std::chrono::steady_clock::time_point start);
+
+  // Whether saving writes a progressive file
+  bool progressiveOutput() const;
+
+  // libjpeg progress hook: notes each scan as jpeg_read_coefficients
+  // reaches it, so scans() can report per-scan decode times
+  struct ScanMonitor {
+    jpeg_progress_mgr pub; // must be first
+    Jpeg *owner = nullptr;
+    std::chrono::steady_clock::time_point scanStart;
+    bool timing = false;
+  };
+  static void onScanProgress(j_common_ptr cinfo);
+  void recordScan();
+  void finishScan();
+
+  // Resolve the address of every coefficient block row after loading
+  void cacheBlockRows();
+
+  // Map the regions onto block spans of every component of the loaded
+  // image (whole rows without regions)
+  void selectBlocks();
+
+  // Count `bytes` of coefficient accesses towards the memory limit of an
+  // image whose blocks are in a temporary file mapping (see
+  // noteVirtArrayAccess); a block reached at random counts as a page
+  void noteCoefficientAccess(size_t bytes) const;
+
+  // Block `index` of the luminance or chrominance coefficients, counted
+  // in extractAC order (component, block row, column) over the selected
+  // blocks
+  JCOEFPTR laneBlock(bool isLuminance, size_t index) const;
+
+  // Visit every selected block of the lane in that order
+  template <typename Visit>
+  void forEachLaneBlock(bool isLuminance, Visit &&visit) const;
+
+  // Visit every non-zero AC coefficient of the lane in block order, in
+  // place, one block row after the other
+  template <typename Visit>
+  void forEachNonZeroAC(bool isLuminance, Visit &&visit);
+
+  // Shared body of the AC sign substitution in both directions
+  void chainACSigns(bool isLuminance, const std::vector<double> &keystream,
+                    int alpha, bool reverse);
+
+  // JPEG internals, borrowed from JpegContextPool
+  JpegContextPool::Lease context;
+  jpeg_decompress_struct &din;
+  jpeg_compress_struct &dout;
+  JpegErrorManager &jerr;
   jvirt_barray_ptr *coeffs = nullptr;
+  std::vector<std::vector<JBLOCKROW>> blockRows; // [component][block row]
+  std::unique_ptr<MappedFile> dumpFile; // holds the blocks of a loaded dump
+
+  // Run of selected blocks in one block row of a component
+  struct BlockSpan {
+    JDIMENSION row = 0;
+    JDIMENSION colBegin = 0, colEnd = 0;
+    size_t firstIndex = 0; // of its first block among the component's
+  };
+  std::vector<Region> regions;
+  std::vector<std::vector<BlockSpan>> spans; // [component]
+  std::vector<size_t> selectedBlocks;        // [component]
 
   int width = 0;
   int height = 0;
   int comps = 0;
+  unsigned restartInterval = 0; // output RST spacing in MCUs, 0 = none
+  size_t memoryLimit = 0;       // coefficient bytes in RAM, 0 = no limit
+  bool coefficientsBacked = false; // blocks in a temporary file mapping
+  HuffmanMode huffmanMode = HuffmanMode::Standard;
+  ScanMode scanMode = ScanMode::Source;
+  ScanMonitor scanMonitor{};
+  std::vector<ScanInfo> scanList;
+  bool sourceScriptUsable = false; // progressive input decoded cleanly
+  SaveStats saveStats;
+  size_t inputBytes = 0;
+  std::string tag;
 };
\ No newline at end of file
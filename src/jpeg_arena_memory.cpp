@@ -0,0 +1,388 @@
+#include "jpeg_arena_memory.hpp"
+#include "arena.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <jerror.h>
+#include <new>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct VirtArray;
+
+// The temporary file mappings of one image's block arrays and how many of
+// their bytes were accessed since the resident size was last looked up
+struct BackingStore {
+  VirtArray *arrays = nullptr; // the image pool's list
+  size_t limit = 0;            // max_memory_to_use
+  size_t baseline = 0;         // residentFileBytes() before the mappings
+  std::atomic<size_t> accessed{0};
+};
+
+// Virtual array control block; one struct serves sample and block arrays
+struct VirtArray {
+  void *buffer = nullptr; // row pointer array once realized
+  JDIMENSION rows = 0;
+  JDIMENSION columns = 0;
+  JDIMENSION maxAccess = 0;
+  size_t elementSize = 0;
+  bool preZero = false;
+  bool isBlockArray = false;
+  int poolId = JPOOL_IMAGE;
+  void *backing = nullptr; // temporary file mapping holding the rows
+  size_t backingBytes = 0;
+  BackingStore *store = nullptr; // set with `backing`
+  VirtArray *next = nullptr;
+};
+
+struct ArenaMemoryManager {
+  jpeg_memory_mgr pub; // must be first: libjpeg sees only this part
+  jpeg_memory_mgr *base;
+  Arena *arena;
+  VirtArray *virtArrays[JPOOL_NUMPOOLS];
+};
+
+ArenaMemoryManager *self(j_common_ptr cinfo) {
+  return reinterpret_cast<ArenaMemoryManager *>(cinfo->mem);
+}
+
+// libjpeg's manager finds its private state through cinfo->mem, so it has
+// to be swapped back in for the duration of every delegated call. (If the
+// base manager fails it longjmps out with itself installed, which leaves
+// the object usable, just without the arena.)
+void *basePermanentAlloc(j_common_ptr cinfo, size_t size, bool large) {
+  ArenaMemoryManager *manager = self(cinfo);
+  cinfo->mem = manager->base;
+  void *p = large ? (*manager->base->alloc_large)(cinfo, JPOOL_PERMANENT, size)
+                  : (*manager->base->alloc_small)(cinfo, JPOOL_PERMANENT, size);
+  cinfo->mem = &manager->pub;
+  return p;
+}
+
+void *arenaAllocate(j_common_ptr cinfo, size_t size) {
+  void *p = nullptr;
+  try {
+    p = self(cinfo)->arena->allocate(size);
+  } catch (const std::bad_alloc &) {
+    p = nullptr;
+  }
+  if (!p)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  return p;
+}
+
+void *allocSmall(j_common_ptr cinfo, int poolId, size_t size) {
+  if (poolId == JPOOL_IMAGE)
+    return arenaAllocate(cinfo, size);
+  if (poolId != JPOOL_PERMANENT)
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, poolId);
+  return basePermanentAlloc(cinfo, size, false);
+}
+
+void *allocLarge(j_common_ptr cinfo, int poolId, size_t size) {
+  if (poolId == JPOOL_IMAGE)
+    return arenaAllocate(cinfo, size);
+  if (poolId != JPOOL_PERMANENT)
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, poolId);
+  return basePermanentAlloc(cinfo, size, true);
+}
+
+// Row pointer array plus all rows in one contiguous allocation
+void **allocRows(j_common_ptr cinfo, int poolId, size_t rowBytes,
+                 JDIMENSION numRows) {
+  auto **rows = static_cast<void **>(
+      allocSmall(cinfo, poolId, numRows * sizeof(void *)));
+  auto *data =
+      static_cast<char *>(allocLarge(cinfo, poolId, rowBytes * numRows));
+  for (JDIMENSION r = 0; r < numRows; ++r)
+    rows[r] = data + r * rowBytes;
+  return rows;
+}
+
+JSAMPARRAY allocSarray(j_common_ptr cinfo, int poolId,
+                       JDIMENSION samplesPerRow, JDIMENSION numRows) {
+  return reinterpret_cast<JSAMPARRAY>(
+      allocRows(cinfo, poolId, samplesPerRow * sizeof(JSAMPLE), numRows));
+}
+
+JBLOCKARRAY allocBarray(j_common_ptr cinfo, int poolId,
+                        JDIMENSION blocksPerRow, JDIMENSION numRows) {
+  return reinterpret_cast<JBLOCKARRAY>(
+      allocRows(cinfo, poolId, blocksPerRow * sizeof(JBLOCK), numRows));
+}
+
+VirtArray *requestVirtArray(j_common_ptr cinfo, int poolId, boolean preZero,
+                            JDIMENSION columns, JDIMENSION rows,
+                            JDIMENSION maxAccess, size_t elementSize,
+                            bool isBlockArray) {
+  if (poolId != JPOOL_IMAGE && poolId != JPOOL_PERMANENT)
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, poolId);
+
+  auto *array = static_cast<VirtArray *>(
+      allocSmall(cinfo, poolId, sizeof(VirtArray)));
+  new (array) VirtArray();
+  array->rows = rows;
+  array->columns = columns;
+  array->maxAccess = maxAccess;
+  array->elementSize = elementSize;
+  array->preZero = preZero != FALSE;
+  array->isBlockArray = isBlockArray;
+  array->poolId = poolId;
+  array->next = self(cinfo)->virtArrays[poolId];
+  self(cinfo)->virtArrays[poolId] = array;
+  return array;
+}
+
+jvirt_sarray_ptr requestVirtSarray(j_common_ptr cinfo, int poolId,
+                                   boolean preZero, JDIMENSION samplesPerRow,
+                                   JDIMENSION numRows, JDIMENSION maxAccess) {
+  return reinterpret_cast<jvirt_sarray_ptr>(
+      requestVirtArray(cinfo, poolId, preZero, samplesPerRow, numRows,
+                       maxAccess, sizeof(JSAMPLE), false));
+}
+
+jvirt_barray_ptr requestVirtBarray(j_common_ptr cinfo, int poolId,
+                                   boolean preZero, JDIMENSION blocksPerRow,
+                                   JDIMENSION numRows, JDIMENSION maxAccess) {
+  return reinterpret_cast<jvirt_barray_ptr>(
+      requestVirtArray(cinfo, poolId, preZero, blocksPerRow, numRows,
+                       maxAccess, sizeof(JBLOCK), true));
+}
+
+#ifndef _WIN32
+
+// Shared mapping of a new, already unlinked file in $TMPDIR (or /tmp);
+// nullptr on failure. The file reads as zeros until written.
+void *mapTemporaryFile(size_t bytes) {
+  const char *dir = std::getenv("TMPDIR");
+  std::string name = std::string(dir && *dir ? dir : "/tmp") +
+                     "/jpeg-coefficients-XXXXXX";
+  int fd = mkstemp(&name[0]);
+  if (fd < 0)
+    return nullptr;
+  unlink(name.c_str());
+  void *p = nullptr;
+  if (ftruncate(fd, static_cast<off_t>(bytes)) == 0) {
+    p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      p = nullptr;
+  }
+  close(fd); // the mapping keeps the file
+  // Faults map single pages: no readahead or fault-around, which would
+  // make the resident part outgrow what noteAccess counts
+  if (p)
+    madvise(p, bytes, MADV_RANDOM);
+  return p;
+}
+
+// Rows of a block array in a temporary file mapping
+void **allocBackedRows(j_common_ptr cinfo, VirtArray *array,
+                       size_t rowBytes, BackingStore *store) {
+  size_t bytes = rowBytes * array->rows;
+  void *data = mapTemporaryFile(bytes);
+  if (!data)
+    ERREXIT(cinfo, JERR_TFILE_CREATE);
+  array->backing = data;
+  array->backingBytes = bytes;
+  array->store = store;
+
+  auto **rows = static_cast<void **>(
+      allocSmall(cinfo, array->poolId, array->rows * sizeof(void *)));
+  for (JDIMENSION r = 0; r < array->rows; ++r)
+    rows[r] = static_cast<char *>(data) + r * rowBytes;
+  return rows;
+}
+
+void releaseBacking(VirtArray *array) {
+  if (array->backing)
+    munmap(array->backing, array->backingBytes);
+  array->backing = nullptr;
+}
+
+// Drop the pages of every mapping of the image from the process; written
+// pages stay in the shared file and are read back on the next access
+void dropResidentPages(BackingStore *store) {
+  for (VirtArray *array = store->arrays; array; array = array->next) {
+    if (array->backing)
+      madvise(array->backing, array->backingBytes, MADV_DONTNEED);
+  }
+}
+
+// File pages mapped into the process (libraries included), from the
+// "shared" field of /proc/self/statm; 0 if that cannot be read
+size_t residentFileBytes() {
+  FILE *statm = std::fopen("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  unsigned long size = 0, resident = 0, shared = 0;
+  int fields = std::fscanf(statm, "%lu %lu %lu", &size, &resident, &shared);
+  std::fclose(statm);
+  return fields == 3 ? shared * size_t(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+#else
+
+// No backing store on Windows: arrays always stay in memory
+void **allocBackedRows(j_common_ptr cinfo, VirtArray *array,
+                       size_t rowBytes, BackingStore *) {
+  return allocRows(cinfo, array->poolId, rowBytes, array->rows);
+}
+
+void releaseBacking(VirtArray *) {}
+
+void dropResidentPages(BackingStore *) {}
+
+size_t residentFileBytes() { return 0; }
+
+#endif
+
+// Count accessed bytes; every 1/32 of the limit, the file-backed memory
+// of the process is looked up, and once the mappings hold half the limit
+// the pages touched so far are dropped. (Faults map more than the pages
+// accessed, so the count alone cannot tell how much is resident.)
+void noteAccess(BackingStore *store, size_t bytes) {
+  if (store->accessed.fetch_add(bytes) + bytes < store->limit / 32)
+    return;
+  store->accessed = 0;
+  if (residentFileBytes() >= store->baseline + store->limit / 2)
+    dropResidentPages(store);
+}
+
+void realizeVirtArrays(j_common_ptr cinfo) {
+  // Like libjpeg's own manager, spill only when the arrays do not fit
+  // into max_memory_to_use; then every block array of the image goes to
+  // the backing store (the sample arrays are small strips)
+  size_t blockBytes = 0;
+  for (int pool = JPOOL_PERMANENT; pool < JPOOL_NUMPOOLS; ++pool) {
+    for (VirtArray *array = self(cinfo)->virtArrays[pool]; array;
+         array = array->next) {
+      if (!array->buffer && array->isBlockArray)
+        blockBytes += size_t(array->columns) * array->elementSize *
+                      array->rows;
+    }
+  }
+  const long limit = self(cinfo)->pub.max_memory_to_use;
+  const bool spill = limit > 0 && blockBytes > size_t(limit);
+
+  for (int pool = JPOOL_PERMANENT; pool < JPOOL_NUMPOOLS; ++pool) {
+    BackingStore *store = nullptr;
+    for (VirtArray *array = self(cinfo)->virtArrays[pool]; array;
+         array = array->next) {
+      if (array->buffer)
+        continue;
+      size_t rowBytes = size_t(array->columns) * array->elementSize;
+      if (spill && array->isBlockArray && array->rows > 0) {
+        if (!store) {
+          store = new (allocSmall(cinfo, pool, sizeof(BackingStore)))
+              BackingStore();
+          store->arrays = self(cinfo)->virtArrays[pool];
+          store->limit = size_t(limit);
+          store->baseline = residentFileBytes();
+        }
+        array->buffer = allocBackedRows(cinfo, array, rowBytes, store);
+        continue; // the file starts out zeroed
+      }
+      void **rows = allocRows(cinfo, array->poolId, rowBytes, array->rows);
+      if (array->preZero && array->rows > 0)
+        std::memset(rows[0], 0, rowBytes * array->rows);
+      array->buffer = rows;
+    }
+  }
+}
+
+void **accessVirtArray(j_common_ptr cinfo, VirtArray *array,
+                       JDIMENSION startRow, JDIMENSION numRows) {
+  if (!array->buffer || numRows > array->maxAccess ||
+      startRow + numRows > array->rows)
+    ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+  // libjpeg reads and writes the coefficients an iMCU row at a time
+  if (array->store)
+    noteAccess(array->store,
+               size_t(numRows) * array->columns * array->elementSize);
+  return static_cast<void **>(array->buffer) + startRow;
+}
+
+JSAMPARRAY accessVirtSarray(j_common_ptr cinfo, jvirt_sarray_ptr ptr,
+                            JDIMENSION startRow, JDIMENSION numRows,
+                            boolean) {
+  return reinterpret_cast<JSAMPARRAY>(accessVirtArray(
+      cinfo, reinterpret_cast<VirtArray *>(ptr), startRow, numRows));
+}
+
+JBLOCKARRAY accessVirtBarray(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+                             JDIMENSION startRow, JDIMENSION numRows,
+                             boolean) {
+  return reinterpret_cast<JBLOCKARRAY>(accessVirtArray(
+      cinfo, reinterpret_cast<VirtArray *>(ptr), startRow, numRows));
+}
+
+void freePool(j_common_ptr cinfo, int poolId) {
+  if (poolId < JPOOL_PERMANENT || poolId >= JPOOL_NUMPOOLS)
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, poolId);
+
+  // libjpeg only releases the permanent pool when the object is destroyed
+  // (see selfDestruct); image pool memory is reclaimed by resetting the
+  // arena, so all that is left is to unmap any backing store and forget
+  // the virtual arrays
+  if (poolId == JPOOL_IMAGE) {
+    for (VirtArray *array = self(cinfo)->virtArrays[poolId]; array;
+         array = array->next)
+      releaseBacking(array);
+    self(cinfo)->virtArrays[poolId] = nullptr;
+  }
+}
+
+void selfDestruct(j_common_ptr cinfo) {
+  for (int pool = JPOOL_PERMANENT; pool < JPOOL_NUMPOOLS; ++pool) {
+    for (VirtArray *array = self(cinfo)->virtArrays[pool]; array;
+         array = array->next)
+      releaseBacking(array);
+  }
+
+  // This struct lives in the base manager's permanent pool and goes with it
+  jpeg_memory_mgr *base = self(cinfo)->base;
+  cinfo->mem = base;
+  (*base->self_destruct)(cinfo);
+}
+
+} // namespace
+
+bool isVirtArrayBacked(jvirt_barray_ptr array) {
+  return array && reinterpret_cast<VirtArray *>(array)->store;
+}
+
+void noteVirtArrayAccess(jvirt_barray_ptr array, size_t bytes) {
+  if (BackingStore *store = reinterpret_cast<VirtArray *>(array)->store)
+    noteAccess(store, bytes);
+}
+
+void installArenaMemoryManager(j_common_ptr cinfo, Arena &arena) {
+  jpeg_memory_mgr *base = cinfo->mem;
+  auto *manager = static_cast<ArenaMemoryManager *>((*base->alloc_small)(
+      cinfo, JPOOL_PERMANENT, sizeof(ArenaMemoryManager)));
+  std::memset(manager, 0, sizeof(ArenaMemoryManager));
+
+  manager->base = base;
+  manager->arena = &arena;
+  manager->pub.alloc_small = allocSmall;
+  manager->pub.alloc_large = allocLarge;
+  manager->pub.alloc_sarray = allocSarray;
+  manager->pub.alloc_barray = allocBarray;
+  manager->pub.request_virt_sarray = requestVirtSarray;
+  manager->pub.request_virt_barray = requestVirtBarray;
+  manager->pub.realize_virt_arrays = realizeVirtArrays;
+  manager->pub.access_virt_sarray = accessVirtSarray;
+  manager->pub.access_virt_barray = accessVirtBarray;
+  manager->pub.free_pool = freePool;
+  manager->pub.self_destruct = selfDestruct;
+  manager->pub.max_memory_to_use = base->max_memory_to_use;
+  manager->pub.max_alloc_chunk = base->max_alloc_chunk;
+  cinfo->mem = &manager->pub;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdio.h> // Ensure FILE is defined
+#include <jpeglib.h>
+
+class Arena;
+
+// Replace the memory manager of a freshly created libjpeg object with one
+// that serves the per-image pool from `arena`.
+//
+// alloc_small/alloc_large, sample/block arrays and the virtual coefficient
+// arrays realized by realize_virt_arrays of JPOOL_IMAGE all come from the
+// arena; freeing the image pool is free, the memory is reclaimed by
+// resetting the arena after the image. The permanent pool stays with
+// libjpeg's own manager.
+//
+// Virtual arrays are kept fully in memory unless `max_memory_to_use` is
+// set and the image's coefficient arrays are larger: then they are placed
+// in an unlinked temporary file mapped into memory (POSIX only), so the
+// kernel pages them out to the file under memory pressure instead of the
+// process growing without bound. Accesses through access_virt_barray, and
+// those reported with noteVirtArrayAccess, are counted, and every so often
+// the process's resident file pages are looked up: once the mappings hold
+// half of `max_memory_to_use`, their pages are dropped from the process
+// (they stay in the file), so its resident coefficients stay within the
+// limit.
+void installArenaMemoryManager(j_common_ptr cinfo, Arena &arena);
+
+// Whether the block array lives in a temporary file mapping
+bool isVirtArrayBacked(jvirt_barray_ptr array);
+
+// Count `bytes` of accesses to the image's block arrays made through row
+// pointers rather than access_virt_barray; any array of the image will
+// do. A no-op for arrays kept in memory.
+void noteVirtArrayAccess(jvirt_barray_ptr array, size_t bytes);
@@ -0,0 +1,97 @@
+#include "jpeg_context_pool.hpp"
+#include "jpeg_arena_memory.hpp"
+
+namespace {
+
+// Route libjpeg errors back to the failing call instead of exiting
+void jpegErrorExit(j_common_ptr cinfo) {
+  (*cinfo->err->output_message)(cinfo);
+  auto *err = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+  longjmp(err->jump, 1);
+}
+
+} // namespace
+
+JpegContext::JpegContext() {
+  din.err = jpeg_std_error(&jerr.pub);
+  dout.err = &jerr.pub;
+  jerr.pub.error_exit = jpegErrorExit;
+  jpeg_create_decompress(&din);
+  jpeg_create_compress(&dout);
+  installArenaMemoryManager((j_common_ptr)&din, arena);
+  installArenaMemoryManager((j_common_ptr)&dout, arena);
+
+  // Any valid input description will do; only the tables are kept
+  dout.in_color_space = JCS_RGB;
+  dout.input_components = 3;
+  jpeg_set_defaults(&dout);
+  for (int t = 0; t < 2; ++t) {
+    standardDc[t] = *dout.dc_huff_tbl_ptrs[t];
+    standardAc[t] = *dout.ac_huff_tbl_ptrs[t];
+  }
+}
+
+JpegContext::~JpegContext() {
+  jpeg_destroy_compress(&dout);
+  jpeg_destroy_decompress(&din);
+}
+
+void JpegContext::reset() {
+  jpeg_abort_compress(&dout);
+  jpeg_abort_decompress(&din);
+  restoreStandardTables();
+  arena.reset();
+}
+
+void JpegContext::restoreStandardTables() {
+  for (int t = 0; t < 2; ++t) {
+    *dout.dc_huff_tbl_ptrs[t] = standardDc[t];
+    *dout.ac_huff_tbl_ptrs[t] = standardAc[t];
+    if (din.dc_huff_tbl_ptrs[t])
+      *din.dc_huff_tbl_ptrs[t] = standardDc[t];
+    if (din.ac_huff_tbl_ptrs[t])
+      *din.ac_huff_tbl_ptrs[t] = standardAc[t];
+  }
+}
+
+void JpegContextPool::Release::operator()(JpegContext *context) const {
+  JpegContextPool::global().release(context);
+}
+
+JpegContextPool &JpegContextPool::global() {
+  static JpegContextPool pool;
+  return pool;
+}
+
+JpegContextPool::Lease JpegContextPool::acquire() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!freeList.empty()) {
+      JpegContext *context = freeList.back().release();
+      freeList.pop_back();
+      return Lease(context);
+    }
+    ++total;
+  }
+  return Lease(new JpegContext());
+}
+
+void JpegContextPool::release(JpegContext *context) {
+  context->reset();
+  std::lock_guard<std::mutex> lock(mutex);
+  freeList.emplace_back(context);
+}
+
+size_t JpegContextPool::created() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return total;
+}
+
+size_t JpegContextPool::idle() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return freeList.size();
+}
+
+size_t JpegContextPool::arenaHighWater() const {
+  return Arena::globalHighWater();
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <stdio.h> // Ensure FILE is defined
+#include "arena.hpp"
+#include <csetjmp>
+#include <jpeglib.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// libjpeg error manager that jumps back to the failing load/save
+struct JpegErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+// A decompress and a compress object created once and reused for many
+// images. Between images they are reset with jpeg_abort_*, which frees the
+// per-image pools but keeps the permanent pool, error manager and the
+// source/destination managers allocated in it. Both objects allocate their
+// per-image memory from the context's arena, which is reset in one go.
+struct JpegContext {
+  JpegContext();
+  ~JpegContext();
+
+  JpegContext(const JpegContext &) = delete;
+  JpegContext &operator=(const JpegContext &) = delete;
+
+  // Return both objects to their start state and reset the arena
+  void reset();
+
+  // Put libjpeg's standard Huffman tables back into slots 0 and 1. Neither
+  // the encoder defaults nor the decoder's fallback for files without DHT
+  // overwrite a table that already exists, so tables written by an
+  // optimized or copied-table save (or read from the previous file) would
+  // otherwise leak into the next image.
+  void restoreStandardTables();
+
+  Arena arena; // declared first: must outlive din/dout
+  jpeg_decompress_struct din{};
+  jpeg_compress_struct dout{};
+  JpegErrorManager jerr{};
+
+  // Managers of each kind, kept so they are allocated only once
+  jpeg_source_mgr *stdioSrc = nullptr;
+  jpeg_source_mgr *memSrc = nullptr;
+  jpeg_source_mgr *mappedSrc = nullptr;
+  jpeg_destination_mgr *stdioDest = nullptr;
+
+  // Standard DC/AC tables (luminance, chrominance) as jpeg_set_defaults
+  // first creates them
+  JHUFF_TBL standardDc[2]{};
+  JHUFF_TBL standardAc[2]{};
+};
+
+// Process-wide free list of JpegContexts.
+//
+// A Jpeg may be decoded on one thread and encoded on another (see the
+// batch pipeline), so contexts are shared by all threads rather than
+// cached per thread; the list is touched once per image.
+class JpegContextPool {
+public:
+  struct Release {
+    void operator()(JpegContext *context) const;
+  };
+  using Lease = std::unique_ptr<JpegContext, Release>;
+
+  static JpegContextPool &global();
+
+  // Borrow an idle context (creating one if none is free)
+  Lease acquire();
+
+  // Contexts created so far / currently idle
+  size_t created() const;
+  size_t idle() const;
+
+  // Largest per-image arena use of any context, for sizing
+  size_t arenaHighWater() const;
+
+private:
+  void release(JpegContext *context);
+
+  mutable std::mutex mutex;
+  std::vector<std::unique_ptr<JpegContext>> freeList;
+  size_t total = 0;
+};
@@ -0,0 +1,94 @@
+#include "keystream_cache.hpp"
+
+KeystreamCache::KeystreamCache(size_t maxBytes) : maxBytes(maxBytes) {}
+
+uint64_t KeystreamCache::entryId(Kind kind, int round, int length) {
+  return (static_cast<uint64_t>(round) << 40) |
+         (static_cast<uint64_t>(kind) << 32) | static_cast<uint32_t>(length);
+}
+
+const KeystreamCache::Entry *KeystreamCache::find(uint64_t id) {
+  auto it = index.find(id);
+  if (it == index.end())
+    return nullptr;
+  lru.splice(lru.begin(), lru, it->second);
+  return &lru.front();
+}
+
+void KeystreamCache::insert(Entry entry) {
+  if (index.count(entry.id))
+    return; // another thread generated it first
+  usedBytes += entry.bytes;
+  lru.push_front(std::move(entry));
+  index[lru.front().id] = lru.begin();
+
+  // Streams still held by running images stay alive through their
+  // shared_ptr; only the cache's reference goes
+  while (usedBytes > maxBytes && lru.size() > 1) {
+    usedBytes -= lru.back().bytes;
+    index.erase(lru.back().id);
+    lru.pop_back();
+  }
+}
+
+KeystreamCache::Stream<int>
+KeystreamCache::ints(Kind kind, int round, int length,
+                     const std::function<std::vector<int>()> &make) {
+  const uint64_t id = entryId(kind, round, length);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (const Entry *entry = find(id)) {
+      ++hitCount;
+      return entry->ints;
+    }
+    ++missCount;
+  }
+
+  // Generate outside the lock: other keystreams can be served meanwhile
+  Entry entry;
+  entry.id = id;
+  entry.ints = std::make_shared<const std::vector<int>>(make());
+  entry.bytes = entry.ints->size() * sizeof(int);
+  Stream<int> stream = entry.ints;
+  std::lock_guard<std::mutex> lock(mutex);
+  insert(std::move(entry));
+  return stream;
+}
+
+KeystreamCache::Stream<double>
+KeystreamCache::doubles(Kind kind, int round, int length,
+                        const std::function<std::vector<double>()> &make) {
+  const uint64_t id = entryId(kind, round, length);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (const Entry *entry = find(id)) {
+      ++hitCount;
+      return entry->doubles;
+    }
+    ++missCount;
+  }
+
+  Entry entry;
+  entry.id = id;
+  entry.doubles = std::make_shared<const std::vector<double>>(make());
+  entry.bytes = entry.doubles->size() * sizeof(double);
+  Stream<double> stream = entry.doubles;
+  std::lock_guard<std::mutex> lock(mutex);
+  insert(std::move(entry));
+  return stream;
+}
+
+size_t KeystreamCache::hits() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return hitCount;
+}
+
+size_t KeystreamCache::misses() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return missCount;
+}
+
+size_t KeystreamCache::bytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return usedBytes;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Keystreams of one master key and its round keys, kept across images.
+// Apart from the
+// intra-block keys (which depend on the coefficients) every keystream the
+// cipher uses depends only on the round key and a length, so images with
+// the same block counts reuse them instead of iterating the chaotic maps
+// again.
+//
+// Entries are evicted least recently used first once their total size
+// exceeds the byte budget. Safe to use from several threads; two threads
+// missing the same entry at once both generate it and one copy is kept.
+class KeystreamCache {
+public:
+  enum class Kind : uint32_t {
+    DCPermutation,     // Jpeg::generateDCPermutationKeystream
+    ACInterBlock,      // Jpeg::generateACInterBlockPermutationKey
+    Logistic           // MasterKey::generateLogisticKeystream
+  };
+
+  template <typename T>
+  using Stream = std::shared_ptr<const std::vector<T>>;
+
+  explicit KeystreamCache(size_t maxBytes = 256u << 20);
+
+  KeystreamCache(const KeystreamCache &) = delete;
+  KeystreamCache &operator=(const KeystreamCache &) = delete;
+
+  // The cached keystream of a cipher round, or the result of `make`
+  // (then cached)
+  Stream<int> ints(Kind kind, int round, int length,
+                   const std::function<std::vector<int>()> &make);
+  Stream<double> doubles(Kind kind, int round, int length,
+                         const std::function<std::vector<double>()> &make);
+
+  size_t hits() const;
+  size_t misses() const;
+  size_t bytes() const;
+
+private:
+  struct Entry {
+    uint64_t id = 0;
+    Stream<int> ints;
+    Stream<double> doubles;
+    size_t bytes = 0;
+  };
+  using Lru = std::list<Entry>; // most recently used first
+
+  static uint64_t entryId(Kind kind, int round, int length);
+
+  // Entry for `id` moved to the front, or nullptr
+  const Entry *find(uint64_t id);
+  void insert(Entry entry);
+
+  mutable std::mutex mutex;
+  Lru lru;
+  std::unordered_map<uint64_t, Lru::iterator> index;
+  size_t maxBytes;
+  size_t usedBytes = 0;
+  size_t hitCount = 0;
+  size_t missCount = 0;
+};
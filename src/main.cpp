@@ -1,12 +1,24 @@
+#include "batch.hpp"
 #include "chaotic_keystream_generator.hpp"
+#include "cipher_graph.hpp"
+#include "cli.hpp"
+#include "daemon.hpp"
+#include "file_io.hpp"
+#include "frame_stream.hpp"
 #include "jpeg.hpp"
-#include <chrono> // Include for timing
+#include "resume_journal.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <random>
+#include <sstream>
 #include <stdio.h>
-#include <thread> // For parallel processing
 
 namespace fs = std::filesystem;
 
@@ -34,230 +46,726 @@ ChaoticSystems::MasterKey generateRandomMasterKey() {
   return key;
 }
 
-int main() {
-  // ======================
-  // === SETUP PATHS ======
-  // ======================
-  fs::path exeDir = fs::current_path();
-  fs::path rawDir = exeDir / ".." / ".." / "images" / "raw";
-  fs::path editedDir = exeDir / ".." / ".." / "images" / "edited";
-  fs::path restoreDir = exeDir / ".." / ".." / "images" / "restored";
-  fs::path keyFile = exeDir / "master_key.txt";
-
-  fs::create_directories(editedDir);
-  fs::create_directories(restoreDir);
-
-  // ===========================
-  // === LOAD OR GENERATE KEY ==
-  // ===========================
-  ChaoticSystems::MasterKey key;
-  if (fs::exists(keyFile)) {
-    std::cout << "[INFO] Loaded master key from: " << keyFile << "\n";
-    key.loadFromFile(keyFile.string());
+// Append the log of one image to stdout in one piece
+void printLog(const std::ostringstream &log) {
+  static std::mutex logMutex;
+  std::lock_guard<std::mutex> lock(logMutex);
+  std::cout << log.str();
+}
+
+// Run the cipher stage graph of all rounds of the profile on an image.
+// Encryption records the profile and regions in the image's tag;
+// decryption follows the tag when the image has one (and clears it), else
+// `profile` and the regions already set. Returns the profile run.
+CipherProfile runCipher(Jpeg &img, const ChaoticSystems::MasterKey &key,
+                        StageGraph::Direction direction, ThreadPool &pool,
+                        const CipherProfile &profile, std::ostream &log,
+                        KeystreamCache *cache = nullptr) {
+  const bool encrypt = direction == StageGraph::Direction::Encrypt;
+  CipherProfile applied = profile;
+  if (encrypt) {
+    img.setTag(formatCipherTag(profile, img.getRegions()));
   } else {
-    std::cout << "[INFO] Generating new master key: " << keyFile << "\n";
-    key = generateRandomMasterKey();
-    key.saveToFile(keyFile.string());
+    std::vector<Jpeg::Region> regions;
+    if (!img.getTag().empty() &&
+        parseCipherTag(img.getTag(), applied, regions))
+      img.setRegions(regions);
+    img.setTag("");
   }
 
-  // ===========================
-  // === PROCESS IMAGE BATCH ===
-  // ===========================
-  for (auto &entry : fs::directory_iterator(rawDir)) {
-    if (!entry.is_regular_file())
-      continue;
+  log << "[INFO] " << (encrypt ? "Encryption" : "Decryption") << " ("
+      << applied.name() << ")\n";
+
+  // === Decryption is the encryption graph run backwards, last round first
+  StageGraph graph;
+  buildCipherGraph(graph, img, key, cache, applied.level, applied.rounds);
+  graph.run(direction, pool);
+  graph.printTimings(direction, log);
+  return applied;
+}
+
+// Encrypt and decrypt an image in memory and check that every coefficient
+// comes back unchanged, without writing or re-decoding any file
+bool verifyImage(const fs::path &file, const ChaoticSystems::MasterKey &key,
+                 ThreadPool &pool, const CipherProfile &profile) {
+  Jpeg img;
+  if (!img.load(file.wstring())) {
+    std::wcerr << L"Failed to load " << file.wstring() << L"\n";
+    return false;
+  }
+
+  std::ostringstream log;
+  log << "[INFO] Verifying " << file.filename().string() << "\n";
+
+  auto original = img.snapshotCoefficients();
+  runCipher(img, key, StageGraph::Direction::Encrypt, pool, profile, log);
+  runCipher(img, key, StageGraph::Direction::Decrypt, pool, profile, log);
+
+  Jpeg::BlockPosition mismatch;
+  bool ok = img.matchesSnapshot(original, &mismatch);
+  if (ok)
+    log << "[VERIFY] " << file.filename().string() << ": OK\n";
+  else
+    log << "[VERIFY] " << file.filename().string()
+        << ": MISMATCH at component " << mismatch.component << ", block row "
+        << mismatch.row << ", block column " << mismatch.col << "\n";
 
-    fs::path inFile = entry.path();
-    fs::path editFile = editedDir / inFile.filename();
-    fs::path restoreFile = restoreDir / inFile.filename();
+  printLog(log);
+  return ok;
+}
+
+void applyOutputOptions(Jpeg &img, const OutputOptions &options) {
+  img.setRestartInterval(options.restartInterval);
+  img.setHuffmanMode(options.huffmanMode);
+  img.setScanMode(options.scanMode);
+}
+
+// Append the scan structure of a loaded image and its decode cost
+void logScans(const Jpeg &img, std::ostream &log) {
+  double total = 0;
+  for (const auto &scan : img.scans())
+    total += scan.decodeMs;
+  log << "[SCANS] " << (img.isProgressive() ? "progressive" : "baseline")
+      << ", " << img.scans().size() << " scan(s), " << std::fixed
+      << std::setprecision(2) << total << " ms decode\n";
+
+  int number = 1;
+  for (const auto &scan : img.scans()) {
+    log << "[SCANS]   #" << number++ << " components";
+    for (int comp : scan.components)
+      log << " " << comp;
+    log << ", Ss=" << scan.ss << " Se=" << scan.se << " Ah=" << scan.ah
+        << " Al=" << scan.al << ": " << scan.decodeMs << " ms\n";
+  }
+}
+
+// Write an image the way it was read: dumps as dumps, JPEGs as JPEGs
+bool saveImage(Jpeg &img, const fs::path &file) {
+  return img.isDump() ? img.saveDump(file.wstring())
+                      : img.save(file.wstring(), 100);
+}
+
+// Whether outDir/<name> is the input itself, which a batch must not write
+// over (logged as an error)
+bool wouldReplaceInput(const fs::path &file, const fs::path &outDir) {
+  std::error_code ec;
+  if (!fs::equivalent(file, outDir / file.filename(), ec))
+    return false;
+  std::cerr << "[ERROR] " << file.string()
+            << ": output would replace the input\n";
+  return true;
+}
+
+// Pipeline stages turning every file of the batch into outDir/<name>,
+// written under a temporary name and renamed into place (every image that
+// fails to load or save counts in `failures`)
+PipelineStages cipherPipeline(const fs::path &outDir,
+                              const ChaoticSystems::MasterKey &key,
+                              StageGraph::Direction direction,
+                              ThreadPool &pool, const OutputOptions &options,
+                              const CipherProfile &profile,
+                              std::atomic<int> &failures) {
+  PipelineStages stages;
+  stages.read = [&failures](const fs::path &file) {
+    auto img = std::make_unique<Jpeg>();
+    if (!img->load(file.wstring())) {
+      std::wcerr << L"Failed to load " << file.wstring() << L"\n";
+      ++failures;
+      return std::unique_ptr<Jpeg>();
+    }
+    return img;
+  };
+  stages.transform = [&key, direction, &pool, options,
+                      profile](Jpeg &img, const fs::path &file) {
+    // Images run concurrently, so the log is printed in one piece
+    std::ostringstream log;
+    log << "[INFO] Processing " << file.filename().string() << "\n";
+    if (options.scanReport)
+      logScans(img, log);
+    runCipher(img, key, direction, pool, profile, log);
+    printLog(log);
+    return true;
+  };
+  stages.write = [outDir, options, &failures](Jpeg &img,
+                                              const fs::path &file) {
+    fs::path outFile = outDir / file.filename();
+    fs::path partFile = outFile;
+    partFile += ".part";
+    applyOutputOptions(img, options);
+    std::error_code ec;
+    if (!saveImage(img, partFile)) {
+      std::wcerr << L"Failed to save " << outFile.wstring() << L"\n";
+      fs::remove(partFile, ec);
+      ++failures;
+      return;
+    }
+    fs::rename(partFile, outFile, ec);
+    if (ec) {
+      std::wcerr << L"Failed to finish " << outFile.wstring() << L"\n";
+      fs::remove(partFile, ec);
+      ++failures;
+      return;
+    }
+
+    // Size drift against the input, per image
+    const Jpeg::SaveStats &stats = img.lastSaveStats();
+    long long delta = static_cast<long long>(stats.outputBytes) -
+                      static_cast<long long>(stats.inputBytes);
+    std::ostringstream log;
+    log << "[INFO] Saved " << outFile.filename().string() << ": "
+        << stats.inputBytes << " -> " << stats.outputBytes << " bytes ("
+        << std::showpos << delta << std::noshowpos << ", "
+        << (img.isDump() ? std::string("dump")
+                         : Jpeg::huffmanModeName(stats.mode) +
+                               std::string(" tables"))
+        << ", " << std::fixed
+        << std::setprecision(1) << stats.encodeMs << " ms)\n";
+    printLog(log);
+  };
+  return stages;
+}
+
+// Pipeline stages rotating every file of the batch from `oldKey` to
+// `newKey`: each image is decoded once, decrypted and encrypted again on
+// the same coefficients, and encoded once. Each key keeps its own
+// keystream cache. An output is written under a temporary name, renamed
+// into place and only then recorded in `journal`, so an interrupted run
+// never counts a partial file as done.
+PipelineStages reencryptPipeline(
+    const fs::path &outDir, const ChaoticSystems::MasterKey &oldKey,
+    const ChaoticSystems::MasterKey &newKey, KeystreamCache &oldCache,
+    KeystreamCache &newCache, ThreadPool &pool, const OutputOptions &options,
+    const CipherProfile &profile, ResumeJournal &journal,
+    std::atomic<int> &failures) {
+  PipelineStages stages =
+      cipherPipeline(outDir, newKey, StageGraph::Direction::Encrypt, pool,
+                     options, profile, failures);
+  stages.transform = [&, options, profile](Jpeg &img, const fs::path &file) {
+    std::ostringstream log;
+    log << "[INFO] Re-encrypting " << file.filename().string() << "\n";
+    if (options.scanReport)
+      logScans(img, log);
+    // The new encryption keeps the file's profile and regions
+    CipherProfile used = runCipher(img, oldKey,
+                                   StageGraph::Direction::Decrypt, pool,
+                                   profile, log, &oldCache);
+    runCipher(img, newKey, StageGraph::Direction::Encrypt, pool, used, log,
+              &newCache);
+    printLog(log);
+    return true;
+  };
+  stages.write = [outDir, options, &journal, &failures](Jpeg &img,
+                                                        const fs::path &file) {
+    fs::path outFile = outDir / file.filename();
+    fs::path partFile = outFile;
+    partFile += ".part";
+    applyOutputOptions(img, options);
+    std::error_code ec;
+    if (!saveImage(img, partFile)) {
+      std::wcerr << L"Failed to save " << partFile.wstring() << L"\n";
+      ++failures;
+      return;
+    }
+    fs::rename(partFile, outFile, ec);
+    if (ec || !journal.record(file)) {
+      std::wcerr << L"Failed to finish " << outFile.wstring() << L"\n";
+      ++failures;
+    }
+  };
+  return stages;
+}
+
+// Pipeline stages converting every file of the batch between JPEG and
+// coefficient dump: a JPEG becomes outDir/<stem>.jcd, a dump is encoded
+// to outDir/<stem>.jpg with the output options
+PipelineStages dumpPipeline(const fs::path &outDir,
+                            const OutputOptions &options,
+                            std::atomic<int> &failures) {
+  PipelineStages stages;
+  stages.read = [&failures](const fs::path &file) {
+    auto img = std::make_unique<Jpeg>();
+    if (!img->load(file.wstring())) {
+      std::wcerr << L"Failed to load " << file.wstring() << L"\n";
+      ++failures;
+      return std::unique_ptr<Jpeg>();
+    }
+    return img;
+  };
+  stages.transform = [](Jpeg &, const fs::path &) { return true; };
+  stages.write = [outDir, options, &failures](Jpeg &img,
+                                              const fs::path &file) {
+    const bool toJpeg = img.isDump();
+    fs::path outFile = outDir / file.filename();
+    outFile.replace_extension(toJpeg ? ".jpg" : ".jcd");
+    applyOutputOptions(img, options);
+    if (toJpeg ? !img.save(outFile.wstring(), 100)
+               : !img.saveDump(outFile.wstring())) {
+      std::wcerr << L"Failed to save " << outFile.wstring() << L"\n";
+      ++failures;
+      return;
+    }
+    const Jpeg::SaveStats &stats = img.lastSaveStats();
+    std::ostringstream log;
+    log << "[DUMP] " << file.filename().string() << " -> "
+        << outFile.filename().string() << ": " << stats.inputBytes << " -> "
+        << stats.outputBytes << " bytes, " << std::fixed
+        << std::setprecision(1) << stats.encodeMs << " ms\n";
+    printLog(log);
+  };
+  return stages;
+}
+
+// Short digest telling keys apart in a resume journal. It is only 32 bits
+// of a non-cryptographic hash, so it gives next to nothing away about the
+// key itself.
+std::string keyFingerprint(const ChaoticSystems::MasterKey &key) {
+  std::ostringstream text;
+  text << std::setprecision(17) << key.logistic_x0 << " " << key.logistic_r
+       << " " << key.jia_x0 << " " << key.jia_y0 << " " << key.jia_z0 << " "
+       << key.jia_w0 << " " << key.alpha << " " << key.burn_in;
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (char c : text.str()) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 16777619u;
+  }
+  std::ostringstream hex;
+  hex << std::hex << std::setw(8) << std::setfill('0') << hash;
+  return hex.str();
+}
+
+// Transform one JPEG from stdin to stdout entirely in memory. The log
+// goes to stderr, so stdout carries nothing but the image.
+int runPipe(StageGraph::Direction direction,
+            const ChaoticSystems::MasterKey &key, ThreadPool &pool,
+            const OutputOptions &options, const CipherProfile &profile) {
+  setBinaryMode(stdin);
+  setBinaryMode(stdout);
+
+  std::vector<uint8_t> input;
+  if (!readAll(stdin, input)) {
+    std::cerr << "[ERROR] Failed to read stdin\n";
+    return 1;
+  }
+  Jpeg img;
+  if (!img.loadFromMemory(input.data(), input.size())) {
+    std::cerr << "[ERROR] stdin is not a readable JPEG\n";
+    return 1;
+  }
 
+  if (options.scanReport)
+    logScans(img, std::cerr);
+  runCipher(img, key, direction, pool, profile, std::cerr);
+
+  applyOutputOptions(img, options);
+  std::vector<uint8_t> output;
+  if (!img.saveToMemory(output) || !writeAll(stdout, output)) {
+    std::cerr << "[ERROR] Failed to write stdout\n";
+    return 1;
+  }
+  return 0;
+}
+
+// Serve encrypt/decrypt requests until stopped, with the key, keystreams,
+// libjpeg contexts and worker threads kept warm between requests
+int runServe(const fs::path &socketPath, const ChaoticSystems::MasterKey &key,
+             ThreadPool &pool, const OutputOptions &options,
+             const CipherProfile &profile) {
+  using Clock = std::chrono::steady_clock;
+  KeystreamCache cache;
+  int code = runDaemon(socketPath, [&](StageGraph::Direction direction,
+                                       const uint8_t *data, size_t size,
+                                       std::vector<uint8_t> &out,
+                                       std::string &error) {
+    auto start = Clock::now();
     Jpeg img;
-    if (!img.load(inFile.wstring())) {
-      std::wcerr << L"Failed to load " << inFile.wstring() << L"\n";
-      continue;
+    if (!img.loadFromMemory(data, size)) {
+      error = "input is not a readable JPEG";
+      return false;
     }
 
-    // ===========================================
-    // === ENCRYPTION LOOP (3 rounds of chaos) ===
-    // ===========================================
-    for (int round = 0; round < 1; ++round) {
-      std::cout << "[INFO] Encryption Round " << round + 1 << "\n";
-
-      // === Run encryption operations in parallel
-      std::thread lumaDCThread([&]() {
-        auto start = std::chrono::high_resolution_clock::now();
-        img.processDCWithKey(true, img.generateDCPermutationKeystream(img.extractDC(true).size(), key));
-        auto end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] DC Luminance Permutation Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img.applyDC(img.substituteDC(img.extractDC(true), key.generateLogisticKeystream(img.extractDC(true).size()), key.alpha), true);
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] DC Luminance Substitution Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-      });
-
-      std::thread chromaDCThread([&]() {
-        auto start = std::chrono::high_resolution_clock::now();
-        img.processDCWithKey(false, img.generateDCPermutationKeystream(img.extractDC(false).size(), key));
-        auto end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] DC Chrominance Permutation Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img.applyDC(img.substituteDC(img.extractDC(false), key.generateLogisticKeystream(img.extractDC(false).size()), key.alpha), false);
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] DC Chrominance Substitution Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-      });
-
-      std::thread lumaACThread([&]() {
-        auto start = std::chrono::high_resolution_clock::now();
-        img.permuteACBlocks(true, img.generateACInterBlockPermutationKey(img.extractAC(true).size(), key.alpha, key.generateLogisticKeystream(img.extractAC(true).size() - 1)));
-        auto end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Luminance Inter-block Permutation Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img.processACIntraBlock(true, img.generateACPermutationKeys(true, key));
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Luminance Intra-block Permutation Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img.substituteACInterBlock(true, key.generateLogisticKeystream(img.extractAC(true).size()));
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Luminance Substitution Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-      });
-
-      std::thread chromaACThread([&]() {
-        auto start = std::chrono::high_resolution_clock::now();
-        img.permuteACBlocks(false, img.generateACInterBlockPermutationKey(img.extractAC(false).size(), key.alpha, key.generateLogisticKeystream(img.extractAC(false).size() - 1)));
-        auto end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Chrominance Inter-block Permutation Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img.processACIntraBlock(false, img.generateACPermutationKeys(false, key));
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Chrominance Intra-block Permutation Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img.substituteACInterBlock(false, key.generateLogisticKeystream(img.extractAC(false).size()));
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Chrominance Substitution Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-      });
-
-      lumaDCThread.join();
-      chromaDCThread.join();
-      lumaACThread.join();
-      chromaACThread.join();
+    std::ostringstream log, stageLog; // stage timings are not logged
+    if (options.scanReport)
+      logScans(img, log);
+    runCipher(img, key, direction, pool, profile, stageLog, &cache);
+    applyOutputOptions(img, options);
+    if (!img.saveToMemory(out)) {
+      error = "failed to encode the output";
+      return false;
     }
 
-    // === Save the encrypted JPEG image
-    if (!img.save(editFile.wstring(), 100)) {
-      std::wcerr << L"Failed to save edited " << editFile.wstring() << L"\n";
-      continue;
+    log << "[SERVE] "
+        << (direction == StageGraph::Direction::Encrypt ? "Encrypted"
+                                                        : "Decrypted")
+        << " " << img.getWidth() << "x" << img.getHeight() << ": " << size
+        << " -> " << out.size() << " bytes in " << std::fixed
+        << std::setprecision(2)
+        << std::chrono::duration<double, std::milli>(Clock::now() - start)
+               .count()
+        << " ms\n";
+    printLog(log);
+    return true;
+  });
+  std::cout << "[INFO] Keystream cache: " << cache.hits() << " hits, "
+            << cache.misses() << " misses, " << cache.bytes() << " bytes\n";
+  return code;
+}
+
+// Hand every input to the daemon on `socketPath`, which writes the output
+// straight into the output file; several requests are in flight at once
+int runClient(const fs::path &socketPath, StageGraph::Direction direction,
+              const std::vector<fs::path> &inputs, const fs::path &outDir,
+              ThreadPool &pool) {
+  fs::create_directories(outDir);
+  std::atomic<int> failures{0};
+  BatchProcessor batch(pool);
+  batch.run(inputs, [&](const fs::path &file) {
+    std::string error;
+    if (!daemonRequest(socketPath, direction, file, outDir / file.filename(),
+                       error)) {
+      std::cerr << "[ERROR] " << file.string() << ": " << error << "\n";
+      ++failures;
+    }
+  });
+  std::cout << "[INFO] Daemon processed " << inputs.size() - failures
+            << " of " << inputs.size() << " images\n";
+  return failures == 0 ? 0 : 1;
+}
+
+// Transform MJPEG / AVI frame streams, one after the other, with their
+// frames in flight on the pool. Every frame is a separate JPEG, so they
+// share the keystream cache and the pooled libjpeg contexts. "-" streams
+// stdin to stdout, with the log on stderr.
+int runFrames(const std::vector<fs::path> &inputs, const fs::path &outDir,
+              StageGraph::Direction direction,
+              const ChaoticSystems::MasterKey &key, ThreadPool &pool,
+              const OutputOptions &options, const CipherProfile &profile) {
+  KeystreamCache cache;
+  FrameTransform transform = [&](const uint8_t *data, size_t size,
+                                 std::vector<uint8_t> &out, int &width,
+                                 int &height) {
+    Jpeg img;
+    if (!img.loadFromMemory(data, size))
+      return false;
+    std::ostringstream stageLog; // per-frame stage timings are not logged
+    runCipher(img, key, direction, pool, profile, stageLog, &cache);
+    applyOutputOptions(img, options);
+    width = img.getWidth();
+    height = img.getHeight();
+    return img.saveToMemory(out);
+  };
+  const size_t window = 2 * pool.size(); // frames in flight
+
+  int failures = 0;
+  for (const auto &input : inputs) {
+    const bool piped = input == "-";
+    std::ostream &log = piped ? std::cerr : std::cout;
+    FILE *in = stdin, *out = stdout;
+    // Streamed into a temporary file, renamed into place once complete
+    fs::path outFile = outDir / input.filename();
+    fs::path partFile = outFile;
+    partFile += ".part";
+    if (piped) {
+      setBinaryMode(stdin);
+      setBinaryMode(stdout);
+    } else {
+      fs::create_directories(outDir);
+      std::error_code ec;
+      if (fs::equivalent(input, outFile, ec)) {
+        log << "[ERROR] " << input.string()
+            << ": output would replace the input\n";
+        ++failures;
+        continue;
+      }
+      in = openFile(input.wstring(), L"rb");
+      out = in ? openFile(partFile.wstring(), L"wb") : nullptr;
+      if (!in || !out) {
+        std::wcerr << L"Failed to open " << (in ? partFile : input).wstring()
+                   << L"\n";
+        if (in)
+          fclose(in);
+        ++failures;
+        continue;
+      }
     }
 
-    // ==================================
-    // === BEGIN DECRYPTION PHASE =======
-    // ==================================
-    Jpeg img2;
-    if (!img2.load(editFile.wstring())) {
-      std::wcerr << L"Failed to reload edited " << editFile.wstring() << L"\n";
+    FrameStreamStats stats;
+    std::string error;
+    bool ok =
+        transformFrameStream(in, out, transform, pool, window, stats, error);
+    if (!piped) {
+      fclose(in);
+      if (fclose(out) != 0 && ok) {
+        ok = false;
+        error = "write error";
+      }
+      std::error_code ec;
+      if (ok)
+        fs::rename(partFile, outFile, ec);
+      if (ec) {
+        ok = false;
+        error = "cannot create " + outFile.string();
+      }
+    }
+    if (!ok) {
+      log << "[ERROR] " << input.string() << ": " << error << "\n";
+      std::error_code ec;
+      if (!piped)
+        fs::remove(partFile, ec); // no half-transformed stream is left
+      ++failures;
       continue;
     }
 
-    // === Run decryption in 3 reverse rounds
-    for (int round = 0; round < 1; ++round) {
-      std::cout << "[INFO] Decryption Round " << round + 1 << "\n";
-
-      std::thread lumaDCDecryptThread([&]() {
-        auto start = std::chrono::high_resolution_clock::now();
-        img2.applyDC(img2.decryptDC(img2.extractDC(true), key.generateLogisticKeystream(img2.extractDC(true).size()), key.alpha), true);
-        auto end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] DC Luminance Substitution Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img2.processDCReverse(true, img2.generateDCPermutationKeystream(img2.extractDC(true).size(), key));
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] DC Luminance Permutation Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-      });
-
-      std::thread chromaDCDecryptThread([&]() {
-        auto start = std::chrono::high_resolution_clock::now();
-        img2.applyDC(img2.decryptDC(img2.extractDC(false), key.generateLogisticKeystream(img2.extractDC(false).size()), key.alpha), false);
-        auto end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] DC Chrominance Substitution Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img2.processDCReverse(false, img2.generateDCPermutationKeystream(img2.extractDC(false).size(), key));
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] DC Chrominance Permutation Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-      });
-
-      std::thread lumaACDecryptThread([&]() {
-        auto start = std::chrono::high_resolution_clock::now();
-        img2.reverseSubstituteACInterBlock(true, key.generateLogisticKeystream(img2.extractAC(true).size()));
-        auto end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Luminance Substitution Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img2.processACIntraBlock(true, img2.generateACPermutationKeys(true, key), true);
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Luminance Intra-block Permutation Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img2.reversePermuteACBlocks(true, img2.generateACInterBlockPermutationKey(img2.extractAC(true).size(), key.alpha, key.generateLogisticKeystream(img2.extractAC(true).size() - 1)));
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Luminance Inter-block Permutation Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-      });
-
-      std::thread chromaACDecryptThread([&]() {
-        auto start = std::chrono::high_resolution_clock::now();
-        img2.reverseSubstituteACInterBlock(false, key.generateLogisticKeystream(img2.extractAC(false).size()));
-        auto end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Chrominance Substitution Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img2.processACIntraBlock(false, img2.generateACPermutationKeys(false, key), true);
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Chrominance Intra-block Permutation Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-
-        start = std::chrono::high_resolution_clock::now();
-        img2.reversePermuteACBlocks(false, img2.generateACInterBlockPermutationKey(img2.extractAC(false).size(), key.alpha, key.generateLogisticKeystream(img2.extractAC(false).size() - 1)));
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "[INFO] AC Chrominance Inter-block Permutation Reverse Time: "
-                  << std::chrono::duration<double>(end - start).count() << " seconds\n";
-      });
-
-      lumaDCDecryptThread.join();
-      chromaDCDecryptThread.join();
-      lumaACDecryptThread.join();
-      chromaACDecryptThread.join();
+    for (const auto &[size, resolution] : stats.resolutions)
+      log << "[FRAMES] " << size.first << "x" << size.second << ": "
+          << resolution.frames << " frames, mean " << std::fixed
+          << std::setprecision(2)
+          << resolution.transformMs / resolution.frames << " ms per frame\n";
+    log << "[FRAMES] " << (piped ? "stdin" : input.filename().string())
+        << ": " << stats.frames
+        << " frames, " << stats.inputBytes << " -> " << stats.outputBytes
+        << " bytes in " << std::setprecision(3) << stats.seconds << " s, "
+        << std::setprecision(1)
+        << (stats.seconds > 0 ? stats.frames / stats.seconds : 0.0)
+        << " fps sustained on " << pool.size() << " threads\n";
+  }
+  return failures == 0 ? 0 : 1;
+}
+
+// Time each phase of encrypting one image without writing anything
+bool benchImage(const fs::path &file, const ChaoticSystems::MasterKey &key,
+                ThreadPool &pool, const OutputOptions &options,
+                const CipherProfile &profile, double &pixels,
+                double &encryptMs) {
+  using Clock = std::chrono::steady_clock;
+  auto ms = [](Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+  };
+
+  Jpeg img;
+  auto start = Clock::now();
+  if (!img.load(file.wstring())) {
+    std::wcerr << L"Failed to load " << file.wstring() << L"\n";
+    return false;
+  }
+  auto decoded = Clock::now();
+
+  std::ostringstream cipherLog; // stage timings are not part of the summary
+  runCipher(img, key, StageGraph::Direction::Encrypt, pool, profile,
+            cipherLog);
+  auto encrypted = Clock::now();
+
+  applyOutputOptions(img, options);
+  std::vector<uint8_t> output;
+  if (!img.saveToMemory(output)) {
+    std::wcerr << L"Failed to encode " << file.wstring() << L"\n";
+    return false;
+  }
+  auto encoded = Clock::now();
+
+  const double imagePixels = double(img.getWidth()) * img.getHeight();
+  pixels += imagePixels;
+  encryptMs += ms(decoded, encrypted);
+
+  std::ostringstream log;
+  log << "[BENCH] " << file.filename().string() << " (" << img.getWidth()
+      << "x" << img.getHeight() << ", " << profile.name() << "): decode "
+      << std::fixed << std::setprecision(2) << ms(start, decoded)
+      << " ms, encrypt " << ms(decoded, encrypted) << " ms ("
+      << imagePixels / 1000 / ms(decoded, encrypted) << " MP/s), encode "
+      << ms(encrypted, encoded) << " ms, " << img.lastSaveStats().inputBytes
+      << " -> " << output.size() << " bytes\n";
+  if (options.scanReport)
+    logScans(img, log);
+  printLog(log);
+  return true;
+}
+
+// Load the key for every command but keygen
+bool loadKey(const fs::path &keyFile, ChaoticSystems::MasterKey &key,
+             std::ostream &info) {
+  if (!fs::exists(keyFile)) {
+    std::cerr << "[ERROR] No master key at " << keyFile
+              << " (create one with `keygen`)\n";
+    return false;
+  }
+  info << "[INFO] Loaded master key from: " << keyFile << "\n";
+  key.loadFromFile(keyFile.string());
+  return true;
+}
+
+int main(int argc, char **argv) {
+  CommandLine cli;
+  std::string error;
+  if (!parseCommandLine(argc, argv, cli, error)) {
+    std::cerr << "[ERROR] " << error << "\n\n";
+    printUsage(std::cerr);
+    return 2;
+  }
+
+  if (cli.command == "keygen") {
+    if (fs::exists(cli.keyFile) && !cli.force) {
+      std::cerr << "[ERROR] " << cli.keyFile
+                << " exists; use --force to replace it\n";
+      return 1;
+    }
+    generateRandomMasterKey().saveToFile(cli.keyFile.string());
+    std::cout << "[INFO] Wrote new master key: " << cli.keyFile << "\n";
+    return 0;
+  }
+
+  const bool piped = cli.inputs.size() == 1 && cli.inputs[0] == "-";
+  const StageGraph::Direction direction =
+      cli.command == "decrypt" ? StageGraph::Direction::Decrypt
+                               : StageGraph::Direction::Encrypt;
+
+  // The daemon holds the key, so a client does not need it
+  if (!cli.socket.empty() && cli.command != "serve") {
+    std::vector<fs::path> inputs;
+    if (!collectInputs(cli, inputs, error)) {
+      std::cerr << "[ERROR] " << error << "\n";
+      return 1;
     }
+    ThreadPool::setGlobalThreadCount(cli.threads);
+    return runClient(cli.socket, direction, inputs, cli.outDir,
+                     ThreadPool::global());
+  }
 
-    // === Save restored image (after full decryption)
-    if (!img2.save(restoreFile.wstring(), 100)) {
-      std::wcerr << L"Failed to save restored " << restoreFile.wstring()
-                 << L"\n";
-      continue;
+  // In pipe mode stdout is the image, so messages go to stderr
+  ChaoticSystems::MasterKey key;
+  if (cli.command != "dump" &&
+      !loadKey(cli.keyFile, key, piped ? std::cerr : std::cout))
+    return 1;
+
+  ThreadPool::setGlobalThreadCount(cli.threads);
+  ThreadPool &pool = ThreadPool::global(); // Shared by every image and stage
+  Jpeg::setDefaultMemoryLimit(size_t(cli.memoryLimit) << 20);
+  Jpeg::setDefaultRegions(cli.regions);
+  if (piped && !cli.frames)
+    return runPipe(direction, key, pool, cli.output, cli.profile);
+  if (cli.command == "serve")
+    return runServe(cli.socket, key, pool, cli.output, cli.profile);
+
+  std::vector<fs::path> inputs;
+  if (piped)
+    inputs.push_back("-");
+  else if (!collectInputs(cli, inputs, error)) {
+    std::cerr << "[ERROR] " << error << "\n";
+    return 1;
+  }
+  if (cli.frames)
+    return runFrames(inputs, cli.outDir, direction, key, pool, cli.output,
+                     cli.profile);
+
+  BatchProcessor batch(pool);
+  batch.setMemoryBudget(uint64_t(cli.memoryBudget) << 20, &std::cout);
+  std::atomic<int> failures{0};
+
+  if (cli.command == "verify") {
+    batch.run(inputs, [&](const fs::path &file) {
+      if (!verifyImage(file, key, pool, cli.profile))
+        ++failures;
+    });
+    std::cout << "[INFO] Verified " << inputs.size() << " images, "
+              << failures << " failed\n";
+  } else if (cli.command == "bench") {
+    // One image at a time, so every figure is that image's alone; with a
+    // list of profiles, every input runs under each in turn
+    std::vector<CipherProfile> profiles = cli.benchProfiles;
+    if (profiles.empty())
+      profiles.push_back(cli.profile);
+    for (const CipherProfile &profile : profiles) {
+      auto start = std::chrono::steady_clock::now();
+      double pixels = 0, encryptMs = 0;
+      for (const auto &file : inputs) {
+        if (!benchImage(file, key, pool, cli.output, profile, pixels,
+                        encryptMs))
+          ++failures;
+      }
+      double seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      std::cout << "[BENCH] " << profile.name() << ": " << inputs.size()
+                << " images in " << std::fixed << std::setprecision(3)
+                << seconds << " s on " << pool.size() << " threads, encrypt "
+                << std::setprecision(1)
+                << (encryptMs > 0 ? pixels / 1000 / encryptMs : 0.0)
+                << " MP/s\n";
+    }
+  } else if (cli.command == "reencrypt") {
+    ChaoticSystems::MasterKey newKey;
+    if (!loadKey(cli.newKeyFile, newKey, std::cout))
+      return 1;
+
+    // Inputs finished by an earlier, interrupted run are skipped
+    fs::create_directories(cli.outDir);
+    ResumeJournal journal;
+    if (!journal.open(cli.outDir / ".reencrypt-journal",
+                      "reencrypt " + keyFingerprint(key) + " -> " +
+                          keyFingerprint(newKey),
+                      error)) {
+      std::cerr << "[ERROR] " << error << "\n";
+      return 1;
+    }
+    std::vector<fs::path> pending;
+    for (const auto &file : inputs) {
+      if (journal.contains(file))
+        continue;
+      if (wouldReplaceInput(file, cli.outDir)) {
+        ++failures;
+        continue;
+      }
+      pending.push_back(file);
     }
+    if (pending.size() + failures < inputs.size())
+      std::cout << "[INFO] Resuming: " << inputs.size() - pending.size() -
+                                               failures
+                << " images already re-encrypted\n";
+
+    KeystreamCache oldCache, newCache;
+    batch.runPipelined(pending,
+                       reencryptPipeline(cli.outDir, key, newKey, oldCache,
+                                         newCache, pool, cli.output,
+                                         cli.profile, journal, failures),
+                       cli.queueDepth);
+    size_t done = std::count_if(
+        inputs.begin(), inputs.end(),
+        [&journal](const fs::path &file) { return journal.contains(file); });
+    std::cout << "[INFO] Re-encrypted " << done << " of " << inputs.size()
+              << " images\n";
+  } else if (cli.command == "dump") {
+    fs::create_directories(cli.outDir);
+    batch.runPipelined(inputs, dumpPipeline(cli.outDir, cli.output, failures),
+                       cli.queueDepth);
+    std::cout << "[INFO] Converted " << inputs.size() - failures << " of "
+              << inputs.size() << " images\n";
+  } else {
+    // encrypt / decrypt: only the graph for that direction runs
+    fs::create_directories(cli.outDir);
+    std::vector<fs::path> pending;
+    for (const auto &file : inputs) {
+      if (wouldReplaceInput(file, cli.outDir))
+        ++failures;
+      else
+        pending.push_back(file);
+    }
+    batch.runPipelined(
+        pending,
+        cipherPipeline(cli.outDir, key, direction, pool, cli.output,
+                       cli.profile, failures),
+        cli.queueDepth);
+    std::cout << "[INFO] Peak per-image libjpeg arena: "
+              << JpegContextPool::global().arenaHighWater() << " bytes\n";
   }
 
-  return 0;
+  if (cli.memoryBudget) {
+    const BatchProcessor::AdmissionStats &stats = batch.admissionStats();
+    std::cout << "[BUDGET] " << stats.images << " images admitted, "
+              << stats.waited << " waited for memory (" << std::fixed
+              << std::setprecision(1) << stats.totalWaitMs << " ms total, "
+              << stats.maxWaitMs << " ms max); peak estimate in flight "
+              << (stats.peakBytes >> 20) << " MB, budget " << cli.memoryBudget
+              << " MB\n";
+  }
+
+  return failures == 0 ? 0 : 1;
 }
@@ -1,5 +1,8 @@
 #pragma once
 #include "chaotic_keystream_generator.hpp" // Replace .cpp with .hpp
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iomanip> // For setting precision
 #include <numeric>
@@ -40,6 +43,36 @@ struct MasterKey {
     in >> alpha >> burn_in;
   }
 
+  // Sub-key of cipher round `round`. Round 0 is the key itself; later
+  // rounds get fresh seeds in the range keygen draws them from, picked by
+  // hashing the key with the round number, so a round key costs nothing
+  // to derive and needs no extra key material. Map parameters stay the
+  // same.
+  MasterKey roundKey(int round) const {
+    MasterKey sub = *this;
+    if (round == 0)
+      return sub;
+    uint64_t state = 0x9E3779B97F4A7C15ull * static_cast<uint64_t>(round);
+    for (double value : {logistic_x0, logistic_r, jia_x0, jia_y0, jia_z0,
+                         jia_w0}) {
+      uint64_t bits;
+      std::memcpy(&bits, &value, sizeof bits);
+      state = mix(state ^ bits);
+    }
+    state = mix(state ^ (static_cast<uint64_t>(alpha) << 32) ^
+                static_cast<uint64_t>(burn_in));
+    auto seed = [&state]() {
+      state = mix(state + 0x9E3779B97F4A7C15ull);
+      return 0.01 + 0.98 * static_cast<double>(state >> 11) * 0x1.0p-53;
+    };
+    sub.logistic_x0 = seed();
+    sub.jia_x0 = seed();
+    sub.jia_y0 = seed();
+    sub.jia_z0 = seed();
+    sub.jia_w0 = seed();
+    return sub;
+  }
+
   // Generate logistic keystream
   std::vector<double> generateLogisticKeystream(int length) const {
     // Assuming the missing argument is alpha, add it as the last parameter
@@ -64,12 +97,24 @@ struct MasterKey {
     const int a = 2, b = 1, c = 1, d = 1;
     const int modN = 256;
 
-    return Arnold3DKeystreamGenerator::generateKeystream(
-        length, burn_in,
+    // Every step yields three values (x, y, z), so a third of the steps
+    // gives the same first `length` values
+    auto keystream = Arnold3DKeystreamGenerator::generateKeystream(
+        (length + 2) / 3, burn_in,
         a, b, c, d,
         modN,
         x0, y0, z0
     );
+    keystream.resize(std::max(length, 0));
+    return keystream;
+  }
+
+private:
+  // splitmix64 finaliser
+  static uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
   }
 };
 
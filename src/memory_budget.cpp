@@ -0,0 +1,54 @@
+#include "memory_budget.hpp"
+#include <algorithm>
+#include <chrono>
+
+MemoryBudget::MemoryBudget(uint64_t limit) : maxBytes(limit) {}
+
+bool MemoryBudget::fits(uint64_t bytes) const {
+  return maxBytes == 0 || usedBytes == 0 || usedBytes + bytes <= maxBytes;
+}
+
+void MemoryBudget::admit(uint64_t bytes) {
+  usedBytes += bytes;
+  peakBytes = std::max(peakBytes, usedBytes);
+}
+
+bool MemoryBudget::tryAcquire(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!fits(bytes))
+    return false;
+  admit(bytes);
+  return true;
+}
+
+double MemoryBudget::acquire(uint64_t bytes) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (fits(bytes)) {
+    admit(bytes);
+    return 0;
+  }
+  auto start = std::chrono::steady_clock::now();
+  released.wait(lock, [this, bytes]() { return fits(bytes); });
+  admit(bytes);
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void MemoryBudget::release(uint64_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    usedBytes -= std::min(bytes, usedBytes);
+  }
+  released.notify_all();
+}
+
+uint64_t MemoryBudget::inUse() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return usedBytes;
+}
+
+uint64_t MemoryBudget::peak() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return peakBytes;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Running total of the estimated memory of the images in flight, held
+// against a fixed budget. An image larger than the whole budget is still
+// admitted once nothing else is in flight, so a batch always progresses.
+class MemoryBudget {
+public:
+  // limit = 0: no budget, every request is admitted at once
+  explicit MemoryBudget(uint64_t limit = 0);
+
+  // Admit `bytes` if they fit now; false otherwise
+  bool tryAcquire(uint64_t bytes);
+
+  // Wait until `bytes` fit and admit them; returns the milliseconds waited
+  double acquire(uint64_t bytes);
+
+  void release(uint64_t bytes);
+
+  uint64_t limit() const { return maxBytes; }
+  uint64_t inUse() const;
+  uint64_t peak() const; // largest inUse() so far
+
+private:
+  bool fits(uint64_t bytes) const;
+  void admit(uint64_t bytes);
+
+  const uint64_t maxBytes;
+  mutable std::mutex mutex;
+  std::condition_variable released;
+  uint64_t usedBytes = 0;
+  uint64_t peakBytes = 0;
+};
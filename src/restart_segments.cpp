@@ -0,0 +1,123 @@
+#include "restart_segments.hpp"
+
+namespace {
+
+unsigned readBE16(const uint8_t *p) { return (unsigned(p[0]) << 8) | p[1]; }
+
+bool isRestart(uint8_t marker) { return marker >= 0xD0 && marker <= 0xD7; }
+
+} // namespace
+
+bool indexRestartSegments(const uint8_t *data, size_t size,
+                          ScanLayout &layout) {
+  layout = ScanLayout();
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    return false;
+
+  // Walk the header markers up to the first SOS
+  size_t pos = 2;
+  bool haveFrame = false;
+  for (;;) {
+    if (pos + 4 > size || data[pos] != 0xFF)
+      return false;
+    while (pos + 1 < size && data[pos + 1] == 0xFF)
+      ++pos; // fill bytes
+    if (pos + 4 > size)
+      return false;
+
+    uint8_t marker = data[pos + 1];
+    size_t length = readBE16(data + pos + 2);
+    if (length < 2 || pos + 2 + length > size)
+      return false;
+
+    if (marker == 0xC0 || marker == 0xC1) {
+      layout.sofOffset = pos;
+      haveFrame = true;
+    } else if ((marker >= 0xC2 && marker <= 0xCF) && marker != 0xC4 &&
+               marker != 0xC8 && marker != 0xCC) {
+      return false; // progressive, lossless, hierarchical or arithmetic
+    } else if (marker == 0xDD && length >= 4) {
+      layout.restartInterval = readBE16(data + pos + 4);
+    } else if (marker == 0xDA) {
+      layout.sosOffset = pos;
+      layout.dataOffset = pos + 2 + length;
+      break;
+    }
+    pos += 2 + length;
+  }
+
+  if (!haveFrame || layout.restartInterval == 0)
+    return false;
+
+  // The scan must interleave every component of the frame
+  if (data[layout.sosOffset + 4] != data[layout.sofOffset + 9])
+    return false;
+
+  // Split the entropy-coded data at RST markers
+  size_t begin = layout.dataOffset;
+  size_t i = begin;
+  while (i + 1 < size) {
+    if (data[i] != 0xFF) {
+      ++i;
+      continue;
+    }
+    uint8_t next = data[i + 1];
+    if (next == 0x00 || next == 0xFF) {
+      i += next == 0x00 ? 2 : 1; // stuffed zero or fill byte
+      continue;
+    }
+    if (isRestart(next)) {
+      layout.segments.push_back({begin, i});
+      i += 2;
+      begin = i;
+      continue;
+    }
+
+    // End of scan: anything but EOI means more scans (or DNL)
+    layout.segments.push_back({begin, i});
+    return next == 0xD9;
+  }
+  return false;
+}
+
+int appendRenumbered(std::vector<uint8_t> &out, const uint8_t *begin,
+                     const uint8_t *end, int nextRestart) {
+  const uint8_t *run = begin;
+  for (const uint8_t *p = begin; p + 1 < end; ++p) {
+    if (p[0] == 0xFF && isRestart(p[1])) {
+      out.insert(out.end(), run, p);
+      appendRestartMarker(out, nextRestart);
+      nextRestart = (nextRestart + 1) & 7;
+      run = p + 2;
+      ++p;
+    } else if (p[0] == 0xFF && p[1] == 0x00) {
+      ++p; // stuffed zero
+    }
+  }
+  out.insert(out.end(), run, end);
+  return nextRestart;
+}
+
+void appendRestartMarker(std::vector<uint8_t> &out, int number) {
+  out.push_back(0xFF);
+  out.push_back(static_cast<uint8_t>(0xD0 + (number & 7)));
+}
+
+void buildSegmentStream(const uint8_t *data, const ScanLayout &layout,
+                        size_t first, size_t last, unsigned height,
+                        std::vector<uint8_t> &out) {
+  out.clear();
+  out.insert(out.end(), data, data + layout.dataOffset);
+  out[layout.sofOffset + 5] = static_cast<uint8_t>(height >> 8);
+  out[layout.sofOffset + 6] = static_cast<uint8_t>(height & 0xFF);
+
+  for (size_t s = first; s < last; ++s) {
+    if (s > first)
+      appendRestartMarker(out, static_cast<int>(s - first - 1));
+    const auto &segment = layout.segments[s];
+    out.insert(out.end(), data + segment.first, data + segment.second);
+  }
+
+  out.push_back(0xFF);
+  out.push_back(0xD9);
+}
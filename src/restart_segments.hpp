@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Byte layout of a single-scan, sequential Huffman JPEG held in memory,
+// as needed to cut its entropy-coded data at restart (RSTn) markers.
+struct ScanLayout {
+  size_t sofOffset = 0;         // SOF marker
+  size_t sosOffset = 0;         // SOS marker, i.e. end of the table headers
+  size_t dataOffset = 0;        // first byte of entropy-coded data
+  unsigned restartInterval = 0; // MCUs per restart segment (DRI)
+
+  // [begin, end) of every restart segment, RST markers excluded
+  std::vector<std::pair<size_t, size_t>> segments;
+};
+
+// Index the restart segments of a JPEG. Returns false unless the file is
+// baseline/extended sequential Huffman with a non-zero restart interval
+// and exactly one scan covering every component.
+bool indexRestartSegments(const uint8_t *data, size_t size,
+                          ScanLayout &layout);
+
+// Append entropy-coded bytes to `out`, rewriting every RST marker so the
+// markers count up from `nextRestart` (mod 8); returns the next number
+int appendRenumbered(std::vector<uint8_t> &out, const uint8_t *begin,
+                     const uint8_t *end, int nextRestart);
+
+// Append an RSTn marker
+void appendRestartMarker(std::vector<uint8_t> &out, int number);
+
+// Build a standalone JPEG holding segments [first, last) of `layout`:
+// the original headers with the frame height set to `height`, the SOS
+// header, the segments joined by RST markers numbered from 0, and EOI
+void buildSegmentStream(const uint8_t *data, const ScanLayout &layout,
+                        size_t first, size_t last, unsigned height,
+                        std::vector<uint8_t> &out);
@@ -0,0 +1,51 @@
+#include "resume_journal.hpp"
+
+namespace fs = std::filesystem;
+
+std::string ResumeJournal::entry(const fs::path &input) {
+  std::error_code ec;
+  fs::path absolute = fs::absolute(input, ec);
+  return (ec ? input : absolute).lexically_normal().string();
+}
+
+bool ResumeJournal::open(const fs::path &file, const std::string &tag,
+                         std::string &error) {
+  const std::string header = "# " + tag;
+  bool exists = fs::exists(file);
+  if (exists) {
+    std::ifstream in(file);
+    std::string line;
+    if (!std::getline(in, line) || line != header) {
+      error = file.string() +
+              " belongs to a different run; remove it to start over";
+      return false;
+    }
+    // A line cut short by an interruption names no finished file
+    while (std::getline(in, line)) {
+      if (!line.empty() && !in.eof())
+        done.insert(line);
+    }
+  }
+
+  out.open(file, std::ios::app);
+  if (!out) {
+    error = "cannot write " + file.string();
+    return false;
+  }
+  if (!exists)
+    out << header << "\n" << std::flush;
+  return true;
+}
+
+bool ResumeJournal::contains(const fs::path &input) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return done.count(entry(input)) != 0;
+}
+
+bool ResumeJournal::record(const fs::path &input) {
+  std::string line = entry(input);
+  std::lock_guard<std::mutex> lock(mutex);
+  done.insert(line);
+  out << line << "\n" << std::flush;
+  return bool(out);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+
+// Inputs a long batch has finished, appended to a file as each one
+// completes, so an interrupted run can be started again and skip them.
+// The first line holds a tag naming what the entries were done with
+// (e.g. a key fingerprint); a journal with another tag is refused.
+class ResumeJournal {
+public:
+  // Load the entries of `file` if it exists, then keep it open for
+  // appending; false with a message in `error`
+  bool open(const std::filesystem::path &file, const std::string &tag,
+            std::string &error);
+
+  bool contains(const std::filesystem::path &input) const;
+
+  // Append `input` and flush it to the file; safe from any thread
+  bool record(const std::filesystem::path &input);
+
+private:
+  static std::string entry(const std::filesystem::path &input);
+
+  mutable std::mutex mutex;
+  std::set<std::string> done;
+  std::ofstream out;
+};
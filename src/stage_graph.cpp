@@ -0,0 +1,126 @@
+#include "stage_graph.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+int StageGraph::addKeystream(const std::string &name, int lane,
+                             std::function<void()> generate,
+                             bool dataDependent) {
+  Node node;
+  node.name = name;
+  node.lane = lane;
+  node.dataDependent = dataDependent;
+  node.forward = generate;
+  node.inverse = std::move(generate);
+  nodes.push_back(std::move(node));
+  return static_cast<int>(nodes.size()) - 1;
+}
+
+int StageGraph::addStage(const std::string &name, int lane,
+                         std::function<void()> forward,
+                         std::function<void()> inverse,
+                         const std::vector<int> &keystreams) {
+  Node node;
+  node.name = name;
+  node.lane = lane;
+  node.isStage = true;
+  node.forward = std::move(forward);
+  node.inverse = std::move(inverse);
+  node.keystreams = keystreams;
+  nodes.push_back(std::move(node));
+  return static_cast<int>(nodes.size()) - 1;
+}
+
+void StageGraph::run(Direction direction, ThreadPool &pool) {
+  const bool reverse = direction == Direction::Decrypt;
+  const int count = static_cast<int>(nodes.size());
+  if (count == 0)
+    return;
+
+  // Order the stages of each lane in execution order
+  std::map<int, std::vector<int>> laneStages;
+  for (int i = 0; i < count; ++i) {
+    if (nodes[i].isStage)
+      laneStages[nodes[i].lane].push_back(i);
+  }
+
+  // Build dependency edges
+  std::vector<std::vector<int>> successors(count);
+  std::vector<int> pending(count, 0);
+  auto addEdge = [&](int from, int to) {
+    successors[from].push_back(to);
+    ++pending[to];
+  };
+
+  for (auto &lane : laneStages) {
+    auto &chain = lane.second;
+    if (reverse)
+      std::reverse(chain.begin(), chain.end());
+
+    for (size_t s = 0; s < chain.size(); ++s) {
+      int stage = chain[s];
+      int previous = s > 0 ? chain[s - 1] : -1;
+
+      if (previous >= 0)
+        addEdge(previous, stage);
+
+      for (int ks : nodes[stage].keystreams) {
+        addEdge(ks, stage);
+        if (nodes[ks].dataDependent && previous >= 0)
+          addEdge(previous, ks);
+      }
+    }
+  }
+
+  // Execute: a finished node releases its successors onto the pool
+  auto state = std::make_shared<RunState>(count);
+  state->graph = this;
+  state->pool = &pool;
+  state->reverse = reverse;
+  state->successors = std::move(successors);
+  for (int i = 0; i < count; ++i)
+    state->pending[i].store(pending[i]);
+
+  for (int i = 0; i < count; ++i) {
+    if (pending[i] == 0)
+      pool.submit([state, i]() { runNode(state, i); });
+  }
+
+  // Help the pool while waiting, so a graph may itself run as a task
+  pool.helpUntil([&state]() { return state->remaining == 0; });
+}
+
+void StageGraph::runNode(const std::shared_ptr<RunState> &state, int index) {
+  Node &node = state->graph->nodes[index];
+  auto start = std::chrono::high_resolution_clock::now();
+  if (state->reverse)
+    node.inverse();
+  else
+    node.forward();
+  auto end = std::chrono::high_resolution_clock::now();
+  node.seconds = std::chrono::duration<double>(end - start).count();
+
+  for (int next : state->successors[index]) {
+    if (state->pending[next].fetch_sub(1) == 1)
+      state->pool->submit([state, next]() { runNode(state, next); });
+  }
+
+  --state->remaining;
+}
+
+void StageGraph::printTimings(Direction direction, std::ostream &out) const {
+  const char *suffix = direction == Direction::Decrypt ? " Reverse" : "";
+  for (const auto &node : nodes) {
+    if (!node.isStage)
+      continue;
+
+    // Keystream generation is reported as part of the stage consuming it
+    double seconds = node.seconds;
+    for (int ks : node.keystreams)
+      seconds += nodes[ks].seconds;
+
+    out << "[INFO] " << node.name << suffix << " Time: " << seconds
+        << " seconds\n";
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// Task graph for the cipher stages of one image.
+//
+// Every node is bound to a lane, i.e. a set of coefficients no other lane
+// touches (e.g. luminance DC). Stages on the same lane are chained in the
+// order they were declared, so two nodes that share data never run at the
+// same time; nodes on different lanes run in parallel. Running the graph
+// in the Decrypt direction walks each lane backwards and calls the inverse
+// of every stage, so decryption never has to be wired up by hand.
+class StageGraph {
+public:
+  enum class Direction { Encrypt, Decrypt };
+
+  // Add a keystream node feeding a later stage. Keystreams that read the
+  // coefficients (dataDependent) run right after the preceding stage of
+  // their lane in the chosen direction; others may start immediately.
+  int addKeystream(const std::string &name, int lane,
+                   std::function<void()> generate, bool dataDependent = false);
+
+  // Add a cipher stage with its forward and inverse transforms and the
+  // keystream nodes it consumes
+  int addStage(const std::string &name, int lane, std::function<void()> forward,
+               std::function<void()> inverse,
+               const std::vector<int> &keystreams = {});
+
+  // Execute all nodes on the pool; the caller helps run queued tasks until
+  // every node has finished
+  void run(Direction direction, ThreadPool &pool);
+
+  // Print per-node timings of the last run in declaration order
+  void printTimings(Direction direction, std::ostream &out = std::cout) const;
+
+private:
+  struct Node {
+    std::string name;
+    int lane = 0;
+    bool isStage = false;
+    bool dataDependent = false;
+    std::function<void()> forward;
+    std::function<void()> inverse;
+    std::vector<int> keystreams;
+    double seconds = 0.0;
+  };
+
+  // Bookkeeping shared by the tasks of one run
+  struct RunState {
+    StageGraph *graph = nullptr;
+    ThreadPool *pool = nullptr;
+    bool reverse = false;
+    std::vector<std::vector<int>> successors;
+    std::vector<std::atomic<int>> pending;
+    std::atomic<int> remaining;
+    explicit RunState(int n) : pending(n), remaining(n) {}
+  };
+
+  static void runNode(const std::shared_ptr<RunState> &state, int index);
+
+  std::vector<Node> nodes;
+};
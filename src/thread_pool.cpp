@@ -0,0 +1,190 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+
+namespace {
+// Pool and queue index of the worker running on this thread
+thread_local const ThreadPool *currentPool = nullptr;
+thread_local unsigned currentWorker = 0;
+
+// Requested size of the global pool (see setGlobalThreadCount)
+std::atomic<unsigned> globalThreadCount{0};
+} // namespace
+
+ThreadPool::ThreadPool(unsigned threadCount) {
+  if (threadCount == 0)
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+  for (unsigned i = 0; i < threadCount; ++i)
+    queues.push_back(std::make_unique<WorkerQueue>());
+  for (unsigned i = 0; i < threadCount; ++i)
+    workers.emplace_back([this, i]() { workerLoop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &worker : workers)
+    worker.join();
+}
+
+ThreadPool &ThreadPool::global() {
+  static ThreadPool pool(globalThreadCount);
+  return pool;
+}
+
+void ThreadPool::setGlobalThreadCount(unsigned threadCount) {
+  globalThreadCount = threadCount;
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  // Workers keep their own follow-up work local; outside callers spread it
+  unsigned index = currentPool == this
+                       ? currentWorker
+                       : nextQueue.fetch_add(1) % queues.size();
+  // Counted under the deque's lock, like the pops, so `queued` never
+  // drops below the tasks actually queued
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    ++queued;
+    queues[index]->tasks.push_back(std::move(task));
+  }
+  // Taking the sleep lock orders the count before any sleeper's check
+  bool helpers;
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    helpers = helpersWaiting > 0;
+  }
+  wake.notify_one();
+  if (helpers)
+    progress.notify_all();
+}
+
+bool ThreadPool::popTask(unsigned preferred, std::function<void()> &task) {
+  const unsigned count = static_cast<unsigned>(queues.size());
+
+  // Own queue first (newest task, still warm in cache)
+  {
+    auto &own = *queues[preferred];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      --queued;
+      return true;
+    }
+  }
+
+  // Then steal the oldest task of another worker
+  for (unsigned k = 1; k < count; ++k) {
+    auto &victim = *queues[(preferred + k) % count];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      --queued;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::runPendingTask() {
+  std::function<void()> task;
+  unsigned preferred = currentPool == this ? currentWorker : 0;
+  if (!popTask(preferred, task))
+    return false;
+  runTask(task);
+  return true;
+}
+
+void ThreadPool::runTask(std::function<void()> &task) {
+  task();
+  // The task may have completed what a helper waits for; checking under
+  // the lock means a helper either sees it or is already asleep
+  bool helpers;
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    helpers = helpersWaiting > 0;
+  }
+  if (helpers)
+    progress.notify_all();
+}
+
+void ThreadPool::helpUntil(const std::function<bool()> &done) {
+  while (!done()) {
+    if (runPendingTask())
+      continue;
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    ++helpersWaiting;
+    progress.wait(lock, [&]() { return queued > 0 || done(); });
+    --helpersWaiting;
+  }
+}
+
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain,
+                             const std::function<void(size_t, size_t)> &body) {
+  if (end <= begin)
+    return;
+  grain = std::max<size_t>(grain, 1);
+
+  const size_t total = end - begin;
+  const size_t maxChunks = static_cast<size_t>(size()) * 4;
+  const size_t chunks = std::min(maxChunks, (total + grain - 1) / grain);
+  if (chunks <= 1) {
+    body(begin, end);
+    return;
+  }
+
+  const size_t step = (total + chunks - 1) / chunks;
+  TaskGroup group(*this);
+  for (size_t first = begin + step; first < end; first += step) {
+    size_t last = std::min(end, first + step);
+    group.run([&body, first, last]() { body(first, last); });
+  }
+  body(begin, std::min(end, begin + step));
+  group.wait();
+}
+
+unsigned ThreadPool::size() const {
+  return static_cast<unsigned>(workers.size());
+}
+
+void ThreadPool::workerLoop(unsigned index) {
+  currentPool = this;
+  currentWorker = index;
+
+  for (;;) {
+    std::function<void()> task;
+    if (popTask(index, task)) {
+      runTask(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    wake.wait(lock, [this]() { return stopping || queued > 0; });
+    if (stopping && queued == 0)
+      return; // stopping and fully drained
+  }
+}
+
+TaskGroup::TaskGroup(ThreadPool &pool)
+    : pool(pool), outstanding(std::make_shared<std::atomic<size_t>>(0)) {}
+
+TaskGroup::~TaskGroup() { wait(); }
+
+void TaskGroup::run(std::function<void()> task) {
+  ++*outstanding;
+  auto counter = outstanding;
+  pool.submit([counter, task = std::move(task)]() {
+    task();
+    --*counter;
+  });
+}
+
+void TaskGroup::wait() {
+  pool.helpUntil([this]() { return *outstanding == 0; });
+}
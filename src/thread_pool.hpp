@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent work-stealing pool of worker threads.
+//
+// Each worker owns a deque: it pushes and pops its own tasks at the back
+// and, when idle, steals from the front of the other workers' deques.
+// Tasks submitted from outside the pool are spread round-robin. Threads
+// waiting for tasks (TaskGroup::wait, parallelFor) run queued work and only
+// sleep when there is none, so nested parallelism never deadlocks the pool.
+class ThreadPool {
+public:
+  // Start the given number of workers (0 = one per hardware thread)
+  explicit ThreadPool(unsigned threadCount = 0);
+
+  // Drain outstanding tasks and join all workers
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Process-wide pool shared by every image and stage
+  static ThreadPool &global();
+
+  // Size of the global pool (0 = one per hardware thread); only has an
+  // effect before the first call to global()
+  static void setGlobalThreadCount(unsigned threadCount);
+
+  // Queue a task for execution on some worker
+  void submit(std::function<void()> task);
+
+  // Run one queued task on the calling thread; false if none was found
+  bool runPendingTask();
+
+  // Run queued tasks on the calling thread until done() holds, sleeping
+  // while there are none. Woken on every submit and finished task, so
+  // done() must only turn true through work run by this pool.
+  void helpUntil(const std::function<bool()> &done);
+
+  // Call body(first, last) over [begin, end) split into chunks of at least
+  // `grain` items. Small ranges run inline without touching the queues.
+  void parallelFor(size_t begin, size_t end, size_t grain,
+                   const std::function<void(size_t, size_t)> &body);
+
+  // Number of worker threads
+  unsigned size() const;
+
+private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void workerLoop(unsigned index);
+  bool popTask(unsigned preferred, std::function<void()> &task);
+  void runTask(std::function<void()> &task);
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> queued{0}; // changed under the deque locks
+  std::atomic<unsigned> nextQueue{0};
+  std::mutex sleepMutex;
+  std::condition_variable wake;
+  std::condition_variable progress; // helpUntil: new or finished work
+  size_t helpersWaiting = 0;        // guarded by sleepMutex
+  bool stopping = false;
+};
+
+// Tracks a set of tasks submitted to a pool so the caller can wait on them
+class TaskGroup {
+public:
+  explicit TaskGroup(ThreadPool &pool);
+  ~TaskGroup();
+
+  // Submit a task that belongs to this group
+  void run(std::function<void()> task);
+
+  // Help the pool until every task of the group has finished
+  void wait();
+
+private:
+  ThreadPool &pool;
+  std::shared_ptr<std::atomic<size_t>> outstanding;
+};